@@ -0,0 +1,152 @@
+/* The in-server variant of BluePulse: the same matching as the daemon
+ * but every A2DP source gets a module-loopback loaded directly by the
+ * server, so no audio ever crosses the client protocol. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <pulse/xmalloc.h>
+#include <pulsecore/core.h>
+#include <pulsecore/hashmap.h>
+#include <pulsecore/idxset.h>
+#include <pulsecore/log.h>
+#include <pulsecore/modargs.h>
+#include <pulsecore/module.h>
+#include <pulsecore/source.h>
+
+#include "../src/bluepulse.h"
+
+PA_MODULE_AUTHOR("Michael Marineau");
+PA_MODULE_DESCRIPTION("Loop back Bluetooth A2DP sources to the default sink");
+PA_MODULE_VERSION(PACKAGE_VERSION);
+PA_MODULE_LOAD_ONCE(true);
+PA_MODULE_USAGE(
+        "latency_msec=<target latency> "
+        "fast_adjust_threshold_msec=<skip ahead above this latency>");
+
+static const char* const valid_modargs[] = {
+    "latency_msec",
+    "fast_adjust_threshold_msec",
+    NULL
+};
+
+struct userdata {
+    pa_core *core;
+    /* source index -> module-loopback index + 1 */
+    pa_hashmap *loopbacks;
+    uint32_t latency_msec;
+    uint32_t threshold_msec;
+};
+
+static pa_hook_result_t source_put(pa_core *c, pa_source *source,
+        struct userdata *u)
+{
+    pa_module *m;
+    char *args;
+
+    if (!source_match(source->proplist))
+        return PA_HOOK_OK;
+
+    if (pa_hashmap_get(u->loopbacks, PA_UINT32_TO_PTR(source->index)))
+        return PA_HOOK_OK;
+
+    pa_log_info("New A2DP Source: %s",
+            pa_strnull(pa_proplist_gets(source->proplist,
+                    PA_PROP_DEVICE_DESCRIPTION)));
+
+    /* make sure the source is not muted */
+    pa_source_set_mute(source, false, false);
+
+    args = loopback_module_args(source->name,
+            u->latency_msec, u->threshold_msec);
+    if (args == NULL)
+        return PA_HOOK_OK;
+
+    if (pa_module_load(&m, c, "module-loopback", args) < 0)
+        pa_log_warn("Failed to load module-loopback for %s", source->name);
+    else
+        pa_hashmap_put(u->loopbacks, PA_UINT32_TO_PTR(source->index),
+                PA_UINT32_TO_PTR(m->index + 1));
+
+    free(args);
+    return PA_HOOK_OK;
+}
+
+static pa_hook_result_t source_unlink(pa_core *c, pa_source *source,
+        struct userdata *u)
+{
+    void *idx;
+
+    idx = pa_hashmap_remove(u->loopbacks, PA_UINT32_TO_PTR(source->index));
+    if (idx == NULL)
+        return PA_HOOK_OK;
+
+    pa_log_info("Removed A2DP Source: %s", source->name);
+
+    /* Usually already on its way out thanks to source_dont_move */
+    pa_module_unload_request_by_index(c, PA_PTR_TO_UINT32(idx) - 1, true);
+
+    return PA_HOOK_OK;
+}
+
+int pa__init(pa_module *m)
+{
+    struct userdata *u;
+    pa_modargs *ma;
+    pa_source *source;
+    uint32_t idx;
+
+    if (!(ma = pa_modargs_new(m->argument, valid_modargs))) {
+        pa_log("Failed to parse module arguments");
+        return -1;
+    }
+
+    m->userdata = u = pa_xnew0(struct userdata, 1);
+    u->core = m->core;
+    u->latency_msec = 100;
+
+    if (pa_modargs_get_value_u32(ma, "latency_msec", &u->latency_msec) < 0 ||
+            pa_modargs_get_value_u32(ma, "fast_adjust_threshold_msec",
+                &u->threshold_msec) < 0) {
+        pa_log("Invalid latency arguments");
+        pa_modargs_free(ma);
+        pa__done(m);
+        return -1;
+    }
+
+    pa_modargs_free(ma);
+
+    u->loopbacks = pa_hashmap_new(pa_idxset_trivial_hash_func,
+            pa_idxset_trivial_compare_func);
+
+    pa_module_hook_connect(m, &m->core->hooks[PA_CORE_HOOK_SOURCE_PUT],
+            PA_HOOK_LATE, (pa_hook_cb_t)source_put, u);
+    pa_module_hook_connect(m, &m->core->hooks[PA_CORE_HOOK_SOURCE_UNLINK],
+            PA_HOOK_EARLY, (pa_hook_cb_t)source_unlink, u);
+
+    /* Pick up any sources that were already there */
+    PA_IDXSET_FOREACH(source, m->core->sources, idx)
+        source_put(m->core, source, u);
+
+    return 0;
+}
+
+void pa__done(pa_module *m)
+{
+    struct userdata *u = m->userdata;
+    void *state, *idx;
+
+    if (u == NULL)
+        return;
+
+    if (u->loopbacks) {
+        PA_HASHMAP_FOREACH(idx, u->loopbacks, state)
+            pa_module_unload_request_by_index(u->core,
+                    PA_PTR_TO_UINT32(idx) - 1, true);
+        pa_hashmap_free(u->loopbacks);
+    }
+
+    pa_xfree(u);
+}
@@ -3,7 +3,226 @@
 /* Used to identify duplicate processes */
 #define APPLICATION_NAME "BluePulse"
 
+/* Tags module-loopback instances loaded on our behalf */
+#define MODULE_TAG "application.name=" APPLICATION_NAME
+
+/* How often module-loopback re-evaluates its rate, in seconds */
+#define MODULE_ADJUST_SEC 1
+
+/* What to do with a fragment that doesn't fit in the sink's buffer */
+enum backpressure {
+    BACKPRESSURE_NONE,
+    BACKPRESSURE_DROP_OLD,
+    BACKPRESSURE_DROP_NEW,
+    BACKPRESSURE_STRETCH,
+};
+
+/* Where the audio is copied from the source to the sink */
+enum engine {
+    ENGINE_STREAM,      /* through a pair of streams in this process */
+    ENGINE_MODULE,      /* by module-loopback inside the server */
+};
+
+/* Sink buffering targets, picked with --profile or by codec */
+struct latency_profile {
+    const char *name;
+    unsigned int prebuf_msec;
+    unsigned int tlength_msec;
+    unsigned int fragsize_msec;     /* record side, 0 for the default */
+};
+
+/* Codec specific buffering, and what came of it */
+struct codec {
+    const char *name;
+    struct latency_profile latency;
+    unsigned int loopbacks;
+    unsigned int underruns, startup_underruns;
+    pa_usec_t played_usec;
+};
+
+extern struct codec codecs[];
+extern const unsigned int n_codecs;
+
+/* Filter length for the in-process resampler */
+enum resample_quality {
+    RESAMPLE_OFF,       /* leave rate conversion to the server */
+    RESAMPLE_FAST,
+    RESAMPLE_MEDIUM,
+    RESAMPLE_BEST,
+};
+
+/* Most sinks one source can be played on */
+#define MAX_SINKS 8
+
+/* Most PulseAudio servers one process can look after */
+#define MAX_SERVERS 16
+
+struct config {
+    enum engine engine;
+    const struct latency_profile *profile;
+    /* use the codec table over the profile when the codec is known */
+    int codec_latency;
+    unsigned int module_latency_msec;
+    enum backpressure backpressure;
+    /* skip ahead when the sink queue exceeds catchup_msec, 0 disables */
+    unsigned int catchup_msec;
+    unsigned int catchup_target_msec;
+    /* recover record streams silent this long on a running source */
+    unsigned int watchdog_msec;
+    /* sink stream volume, 100 leaves the stream at full volume */
+    unsigned int volume_percent;
+    enum resample_quality resample;
+    /* play on these instead of the default sink */
+    const char *sinks[MAX_SINKS];
+    unsigned int n_sinks;
+    /* budget for stream buffers in kB, 0 leaves them to the server */
+    unsigned int memory_kb;
+    /* servers to connect to, none means just the default one */
+    const char *servers[MAX_SERVERS];
+    unsigned int n_servers;
+    /* streams get a connection of their own, apart from introspection */
+    int data_context;
+    /* count cycles, cache misses and CPU time of the forwarding path */
+    int perf;
+    /* record loopbacks whose source name or description contains
+     * tap_match, or all of them, to WAV files in tap_dir */
+    const char *tap_dir;
+    const char *tap_match;
+};
+
+extern struct config config;
+
+/* A backend discovers A2DP sources and owns their loopbacks */
+struct backend {
+    const char *name;
+    int (*init)(pa_mainloop_api *api);
+    void (*quit)();
+    void (*stats)();
+    /* optional, get ready for a device that is about to appear, codec
+     * is named as in bluetooth.codec or NULL while it isn't known */
+    void (*prearm)(const char *device, const char *codec);
+    void (*disarm)(const char *device);
+    /* optional, apply the configuration that replaced old, which was
+     * read starting at start_usec */
+    void (*reload)(const struct config *old, pa_usec_t start_usec);
+};
+
+extern const struct backend pulse_backend;
+#ifdef HAVE_PIPEWIRE
+extern const struct backend pipewire_backend;
+#endif
+
+#ifdef HAVE_BLUEZ
+int bluez_init(const char *address, const struct backend *backend);
+void bluez_quit();
+#endif
+
+/* One loopback as remembered in the state file */
+#define STATE_SLOTS 32
+#define STATE_NAME_MAX 128
+
+struct state_entry {
+    uint32_t used;
+    uint32_t stretched;
+    char server[STATE_NAME_MAX];
+    char source[STATE_NAME_MAX];
+    char sink[STATE_NAME_MAX];
+    char description[STATE_NAME_MAX];
+    char codec[32];
+    pa_sample_spec spec;
+    pa_buffer_attr attr;
+};
+
 void quit(int retval);
 
+int state_open(const char *path);
+void state_close();
+struct state_entry* state_slot(const char *server, const char *source);
+void state_release(struct state_entry *e);
+struct state_entry* state_next(const char *server, int *i);
+
+struct codec* codec_get(const char *name);
+struct codec* codec_find(pa_proplist *p);
+int codec_parse(const char *arg);
+void codec_reset();
+
+int source_match(pa_proplist *p);
+char *loopback_module_args(const char *source,
+        unsigned int latency_msec, unsigned int threshold_msec);
+
+struct resampler;
+struct resampler* resampler_new(unsigned int channels, uint32_t in_rate,
+        uint32_t out_rate, enum resample_quality quality);
+void resampler_free(struct resampler *r);
+const char* resampler_kernel(struct resampler *r);
+int resampler_set_kernel(struct resampler *r, const char *name);
+size_t resampler_memory(struct resampler *r);
+size_t resampler_out_max(struct resampler *r, size_t in_frames);
+size_t resampler_process_float(struct resampler *r, const float *in,
+        size_t in_frames, float *out);
+size_t resampler_process_s16(struct resampler *r, const int16_t *in,
+        size_t in_frames, int16_t *out);
+
+struct tap;
+struct tap* tap_new(const char *dir, const char *name,
+        const pa_sample_spec *spec);
+void tap_write(struct tap *t, const void *data, size_t len);
+void tap_stats(struct tap *t, uint64_t *written, uint64_t *dropped);
+void tap_free(struct tap *t);
+void tap_drain();
+
+/* Record types of a --trace file, see trace.c */
+#define TRACE_MAGIC 0x32545042 /* "BPT2" */
+/* the first version, without stream callbacks or client and module
+ * replies */
+#define TRACE_MAGIC_V1 0x31545042 /* "BPT1" */
+
+enum trace_type {
+    TRACE_EVENT,        /* subscription event */
+    TRACE_SOURCE,       /* source info reply */
+    TRACE_SINK,         /* default sink info reply */
+    TRACE_READ,         /* record stream data */
+    TRACE_STREAM,       /* stream became ready or failed */
+    TRACE_STARTED,      /* sink stream started playing */
+    TRACE_UNDERFLOW,    /* sink stream ran dry */
+    TRACE_CLIENT,       /* client info reply */
+    TRACE_MODULE,       /* module info reply */
+};
+
+int trace_open(const char *path, unsigned int servers);
+void trace_close();
+void trace_event(unsigned int server, uint32_t type, uint32_t idx);
+void trace_source(unsigned int server, const pa_source_info *i, int eol);
+void trace_sink(unsigned int server, const pa_sink_info *i, int eol);
+void trace_read(unsigned int server, uint32_t source_idx, size_t len);
+void trace_stream(unsigned int server, uint32_t serial,
+        pa_stream_state_t state);
+void trace_started(unsigned int server, uint32_t serial);
+void trace_underflow(unsigned int server, uint32_t serial);
+void trace_client(unsigned int server, const pa_client_info *i, int eol);
+void trace_module(unsigned int server, const pa_module_info *i, int eol);
+
+/* Costs measured with --perf, see perf.c */
+struct perf_counts {
+    uint64_t cycles;
+    uint64_t cache_misses;
+    uint64_t context_switches;
+    uint64_t nsec;
+};
+
+struct perf_stats {
+    struct perf_counts total;
+    uint64_t bytes;
+    unsigned long samples;
+};
+
+int perf_init();
+void perf_quit();
+void perf_read(struct perf_counts *c);
+void perf_add(struct perf_stats *s, const struct perf_counts *start,
+        size_t bytes);
+void perf_report(const char *what, const struct perf_stats *s);
+
 int pulse_init(pa_mainloop_api *api);
 void pulse_quit();
+void pulse_stats();
@@ -0,0 +1,259 @@
+#include <glib.h>
+#include <gio/gio.h>
+#include <string.h>
+
+#include "bluepulse.h"
+
+/* Watches BlueZ on the system bus so the backend can get a device's
+ * sink ready while the card profile and source are still being set up. */
+
+#define BLUEZ_SERVICE "org.bluez"
+#define DEVICE_INTERFACE "org.bluez.Device1"
+#define TRANSPORT_INTERFACE "org.bluez.MediaTransport1"
+
+/* The remote device offers A2DP audio... */
+#define AUDIO_SOURCE_UUID "0000110a-0000-1000-8000-00805f9b34fb"
+/* ...and streams it to our local A2DP sink endpoint */
+#define AUDIO_SINK_UUID "0000110b-0000-1000-8000-00805f9b34fb"
+
+static GDBusConnection *bus;
+static guint props_watch, added_watch, removed_watch;
+static const struct backend *target;
+
+/* A2DP codec ids from the transport's Codec property */
+#define CODEC_SBC 0x00
+#define CODEC_AAC 0x02
+#define CODEC_VENDOR 0xff
+
+/* Vendor codecs, told apart by the vendor and codec ids at the start
+ * of the transport's Configuration */
+static const struct {
+    uint32_t vendor;
+    uint16_t id;
+    const char *name;
+} vendor_codecs[] = {
+    {0x0000004f, 0x0001, "aptx"},
+    {0x000000d7, 0x0024, "aptx_hd"},
+    {0x0000000a, 0x0002, "aptx_ll"},
+    {0x0000000a, 0x0001, "faststream"},
+    {0x0000012d, 0x00aa, "ldac"},
+};
+
+/* The codec as bluetooth.codec will name it, NULL if unknown */
+static const char* transport_codec(GVariant *props)
+{
+    GVariant *config;
+    const guint8 *data;
+    uint32_t vendor;
+    uint16_t id;
+    guint8 codec;
+    gsize n, i;
+
+    if (!g_variant_lookup(props, "Codec", "y", &codec))
+        return NULL;
+    if (codec == CODEC_SBC)
+        return "sbc";
+    if (codec == CODEC_AAC)
+        return "aac";
+    if (codec != CODEC_VENDOR)
+        return NULL;
+
+    config = g_variant_lookup_value(props, "Configuration",
+            G_VARIANT_TYPE_BYTESTRING);
+    if (config == NULL)
+        return NULL;
+
+    data = g_variant_get_fixed_array(config, &n, 1);
+    if (n < 6) {
+        g_variant_unref(config);
+        return NULL;
+    }
+    vendor = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+    id = data[4] | data[5] << 8;
+    g_variant_unref(config);
+
+    for (i = 0; i < G_N_ELEMENTS(vendor_codecs); i++) {
+        if (vendor_codecs[i].vendor == vendor && vendor_codecs[i].id == id)
+            return vendor_codecs[i].name;
+    }
+
+    return NULL;
+}
+
+/* /org/bluez/hci0/dev_AA_BB_CC_DD_EE_FF/sep1/fd0 -> AA_BB_CC_DD_EE_FF */
+static char* device_key(const char *path)
+{
+    const char *start, *end;
+
+    start = strstr(path, "/dev_");
+    if (start == NULL)
+        return NULL;
+
+    start += 5;
+    end = strchr(start, '/');
+    return end ? g_strndup(start, end - start) : g_strdup(start);
+}
+
+static void device_event(const char *path, int connected, const char *codec)
+{
+    char *device = device_key(path);
+
+    if (device == NULL)
+        return;
+
+    if (connected)
+        target->prearm(device, codec);
+    else
+        target->disarm(device);
+
+    g_free(device);
+}
+
+static void device_uuids(GObject *obj, GAsyncResult *res, gpointer data)
+{
+    char *path = data;
+    GVariant *reply, *uuids;
+    const gchar **list;
+    gsize i, n;
+
+    reply = g_dbus_connection_call_finish(bus, res, NULL);
+    if (reply == NULL) {
+        g_free(path);
+        return;
+    }
+
+    g_variant_get(reply, "(v)", &uuids);
+    list = g_variant_get_strv(uuids, &n);
+    for (i = 0; i < n; i++) {
+        if (!g_ascii_strcasecmp(list[i], AUDIO_SOURCE_UUID)) {
+            device_event(path, 1, NULL);
+            break;
+        }
+    }
+
+    g_free(list);
+    g_variant_unref(uuids);
+    g_variant_unref(reply);
+    g_free(path);
+}
+
+static void properties_changed(GDBusConnection *c, const gchar *sender,
+        const gchar *path, const gchar *interface, const gchar *signal,
+        GVariant *params, gpointer data)
+{
+    const gchar *iface;
+    GVariant *changed;
+    gboolean connected;
+
+    g_variant_get(params, "(&s@a{sv}@as)", &iface, &changed, NULL);
+
+    if (!strcmp(iface, DEVICE_INTERFACE) &&
+            g_variant_lookup(changed, "Connected", "b", &connected)) {
+        if (!connected)
+            device_event(path, 0, NULL);
+        else {
+            /* Only worth arming for devices that can send us audio */
+            g_dbus_connection_call(bus, BLUEZ_SERVICE, path,
+                    "org.freedesktop.DBus.Properties", "Get",
+                    g_variant_new("(ss)", DEVICE_INTERFACE, "UUIDs"),
+                    G_VARIANT_TYPE("(v)"), G_DBUS_CALL_FLAGS_NONE,
+                    -1, NULL, device_uuids, g_strdup(path));
+        }
+    }
+
+    g_variant_unref(changed);
+}
+
+static void interfaces_added(GDBusConnection *c, const gchar *sender,
+        const gchar *path, const gchar *interface, const gchar *signal,
+        GVariant *params, gpointer data)
+{
+    const gchar *object, *uuid;
+    GVariant *ifaces, *props;
+
+    g_variant_get(params, "(&o@a{sa{sv}})", &object, &ifaces);
+
+    /* A transport for our sink endpoint means A2DP is being set up,
+     * and it tells which codec was negotiated */
+    props = g_variant_lookup_value(ifaces, TRANSPORT_INTERFACE,
+            G_VARIANT_TYPE_VARDICT);
+    if (props != NULL) {
+        if (g_variant_lookup(props, "UUID", "&s", &uuid) &&
+                !g_ascii_strcasecmp(uuid, AUDIO_SINK_UUID))
+            device_event(object, 1, transport_codec(props));
+        g_variant_unref(props);
+    }
+
+    g_variant_unref(ifaces);
+}
+
+static void interfaces_removed(GDBusConnection *c, const gchar *sender,
+        const gchar *path, const gchar *interface, const gchar *signal,
+        GVariant *params, gpointer data)
+{
+    const gchar *object, **ifaces;
+    gsize i, n;
+
+    g_variant_get(params, "(&o^a&s)", &object, &ifaces);
+    n = g_strv_length((gchar**)ifaces);
+    for (i = 0; i < n; i++) {
+        if (!strcmp(ifaces[i], DEVICE_INTERFACE))
+            device_event(object, 0, NULL);
+    }
+
+    g_free(ifaces);
+}
+
+int bluez_init(const char *address, const struct backend *backend)
+{
+    GError *error = NULL;
+
+    if (!backend->prearm || !backend->disarm) {
+        g_warning("The %s backend can't use the BlueZ watcher",
+                backend->name);
+        return 1;
+    }
+
+    if (address)
+        bus = g_dbus_connection_new_for_address_sync(address,
+                G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                NULL, NULL, &error);
+    else
+        bus = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+
+    if (bus == NULL) {
+        g_warning("D-Bus connection failure: %s", error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    target = backend;
+
+    props_watch = g_dbus_connection_signal_subscribe(bus, BLUEZ_SERVICE,
+            "org.freedesktop.DBus.Properties", "PropertiesChanged",
+            NULL, DEVICE_INTERFACE, G_DBUS_SIGNAL_FLAGS_NONE,
+            properties_changed, NULL, NULL);
+    added_watch = g_dbus_connection_signal_subscribe(bus, BLUEZ_SERVICE,
+            "org.freedesktop.DBus.ObjectManager", "InterfacesAdded",
+            NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+            interfaces_added, NULL, NULL);
+    removed_watch = g_dbus_connection_signal_subscribe(bus, BLUEZ_SERVICE,
+            "org.freedesktop.DBus.ObjectManager", "InterfacesRemoved",
+            NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+            interfaces_removed, NULL, NULL);
+
+    return 0;
+}
+
+void bluez_quit()
+{
+    if (bus == NULL)
+        return;
+
+    g_dbus_connection_signal_unsubscribe(bus, props_watch);
+    g_dbus_connection_signal_unsubscribe(bus, added_watch);
+    g_dbus_connection_signal_unsubscribe(bus, removed_watch);
+    g_object_unref(bus);
+    bus = NULL;
+}
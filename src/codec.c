@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pulse/pulseaudio.h>
+
+#include "bluepulse.h"
+
+/* Buffering per Bluetooth codec. The names are matched as prefixes of
+ * bluetooth.codec in order, so more specific ones come first. SBC sends
+ * small regular frames; AAC and LDAC come in bigger, burstier packets
+ * and want more slack; aptX is small and steady. */
+#define CODEC(name, prebuf, tlength, fragsize) \
+    {name, {name, prebuf, tlength, fragsize}}
+
+struct codec codecs[] = {
+    CODEC("sbc_xq", 50, 180, 10),
+    CODEC("sbc", 40, 150, 10),
+    CODEC("aac", 80, 250, 25),
+    CODEC("aptx_ll", 20, 60, 5),
+    CODEC("aptx_hd", 40, 150, 10),
+    CODEC("aptx", 30, 120, 10),
+    CODEC("faststream", 30, 100, 10),
+    CODEC("ldac", 80, 250, 20),
+};
+
+const unsigned int n_codecs = sizeof(codecs) / sizeof(codecs[0]);
+
+/* Match a bluetooth.codec value against the table */
+struct codec* codec_get(const char *name)
+{
+    unsigned int i;
+
+    if (name == NULL || !*name)
+        return NULL;
+
+    for (i = 0; i < n_codecs; i++) {
+        if (!strncmp(name, codecs[i].name, strlen(codecs[i].name)))
+            return &codecs[i];
+    }
+
+    return NULL;
+}
+
+struct codec* codec_find(pa_proplist *p)
+{
+    return codec_get(pa_proplist_gets(p, "bluetooth.codec"));
+}
+
+/* Tune one entry: NAME=FRAGSIZE/PREBUF/TLENGTH in milliseconds */
+int codec_parse(const char *arg)
+{
+    unsigned int fragsize, prebuf, tlength, i;
+    char name[32];
+
+    if (sscanf(arg, "%31[^=]=%u/%u/%u", name, &fragsize, &prebuf,
+                &tlength) != 4)
+        return 1;
+
+    if (prebuf > tlength || tlength > 10000 || fragsize > tlength)
+        return 1;
+
+    for (i = 0; i < n_codecs; i++) {
+        if (!strcmp(name, codecs[i].name)) {
+            codecs[i].latency.fragsize_msec = fragsize;
+            codecs[i].latency.prebuf_msec = prebuf;
+            codecs[i].latency.tlength_msec = tlength;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* The first call remembers the table as built in, later ones undo
+ * codec_parse() so the settings can be read again */
+void codec_reset()
+{
+    static struct latency_profile *defaults;
+    unsigned int i;
+
+    if (defaults == NULL) {
+        defaults = malloc(sizeof(*defaults) * n_codecs);
+        for (i = 0; i < n_codecs; i++)
+            defaults[i] = codecs[i].latency;
+        return;
+    }
+
+    for (i = 0; i < n_codecs; i++)
+        codecs[i].latency = defaults[i];
+}
@@ -0,0 +1,25 @@
+#ifndef BLUEPULSE_DEFAULTS_H
+#define BLUEPULSE_DEFAULTS_H
+
+/* The latency profiles and what is used without options, also for
+ * tools/replay to run the daemon as it would be started plainly.
+ * Include after bluepulse.h. */
+
+static const struct latency_profile profiles[] = {
+    {"low", 20, 60},
+    {"normal", 50, 200},
+    {"high", 150, 500},
+};
+
+static const struct config defaults = {
+    .engine = ENGINE_STREAM,
+    .profile = &profiles[1],
+    .codec_latency = 1,
+    .module_latency_msec = 100,
+    .backpressure = BACKPRESSURE_NONE,
+    .catchup_target_msec = 100,
+    .watchdog_msec = 2000,
+    .volume_percent = 100,
+};
+
+#endif
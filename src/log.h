@@ -0,0 +1,46 @@
+#ifndef BLUEPULSE_LOG_H
+#define BLUEPULSE_LOG_H
+
+/* glib's logging and assert macros, or stand-ins for the lean build */
+
+#ifdef HAVE_GLIB
+#include <glib.h>
+#else
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+#define G_N_ELEMENTS(a) (sizeof(a) / sizeof((a)[0]))
+
+#define g_message(...) log_print("Message", __VA_ARGS__)
+#define g_warning(...) log_print("WARNING", __VA_ARGS__)
+#define g_critical(...) log_print("CRITICAL", __VA_ARGS__)
+
+#define g_assert(expr) do { \
+    if (!(expr)) \
+        log_abort(__FILE__, __LINE__, #expr); \
+} while (0)
+#define g_assert_not_reached() log_abort(__FILE__, __LINE__, "not reached")
+
+__attribute__((format(printf, 2, 3)))
+static inline void log_print(const char *level, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    fprintf(stderr, "** %s: ", level);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+__attribute__((noreturn))
+static inline void log_abort(const char *file, int line, const char *expr)
+{
+    fprintf(stderr, "** ERROR: %s:%d: assertion failed: (%s)\n",
+            file, line, expr);
+    abort();
+}
+#endif
+
+#endif
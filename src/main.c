@@ -1,20 +1,141 @@
-#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <signal.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <pulse/pulseaudio.h>
+#ifdef HAVE_GLIB
 #include <pulse/glib-mainloop.h>
+#endif
 
+#include "log.h"
 #include "bluepulse.h"
+#include "defaults.h"
 
+struct config config;
+
+/* What a config file change can alter on running loopbacks, the
+ * rest only takes effect on a restart */
+#define RELOADABLE_OPTIONS "pCbctwv"
+
+static const struct backend *backends[] = {
+    &pulse_backend,
+#ifdef HAVE_PIPEWIRE
+    &pipewire_backend,
+#endif
+};
+
+static const struct backend *backend = &pulse_backend;
+static const char *state_path;
+static const char *trace_path;
+static const char *config_path;
+static int config_fd = -1;
+static pa_io_event *config_io;
+/* startup options from the file, to tell when they change */
+static char *config_fixed;
+static int saved_argc;
+static char **saved_argv;
+#ifdef HAVE_BLUEZ
+static int bluez;
+static const char *bluez_address;
+#endif
+#ifdef HAVE_GLIB
 static GMainLoop *mainloop;
 static pa_glib_mainloop *pulse_mainloop;
+#else
+static pa_mainloop *mainloop;
+#endif
 static pa_mainloop_api *pulse_api;
 static int returncode = 1;
+/* main loop iterations outside of poll(), with --perf */
+static struct perf_stats dispatch_perf;
+static struct perf_counts dispatch_start;
+static int dispatching;
+
+/* The lean build runs libpulse's own main loop, otherwise glib's
+ * is used so GIO based code such as the BlueZ watcher can share it */
+static void mainloop_new()
+{
+#ifdef HAVE_GLIB
+    mainloop = g_main_loop_new(NULL, FALSE);
+    pulse_mainloop = pa_glib_mainloop_new(NULL);
+    pulse_api = pa_glib_mainloop_get_api(pulse_mainloop);
+#else
+    mainloop = pa_mainloop_new();
+    pulse_api = pa_mainloop_get_api(mainloop);
+#endif
+}
+
+/* Everything between two polls is one round of dispatching */
+static int perf_poll(struct pollfd *fds, unsigned long n, int timeout)
+{
+    int ret;
+
+    if (dispatching)
+        perf_add(&dispatch_perf, &dispatch_start, 0);
+    ret = poll(fds, n, timeout);
+    perf_read(&dispatch_start);
+    dispatching = 1;
+    return ret;
+}
+
+#ifdef HAVE_GLIB
+static gint perf_poll_glib(GPollFD *fds, guint n, gint timeout)
+{
+    /* GPollFD is laid out as struct pollfd on unix */
+    return perf_poll((struct pollfd*)fds, n, timeout);
+}
+#else
+static int perf_poll_pulse(struct pollfd *fds, unsigned long n, int timeout,
+        void *data)
+{
+    return perf_poll(fds, n, timeout);
+}
+#endif
+
+static void mainloop_perf()
+{
+#ifdef HAVE_GLIB
+    g_main_context_set_poll_func(NULL, perf_poll_glib);
+#else
+    pa_mainloop_set_poll_func(mainloop, perf_poll_pulse, NULL);
+#endif
+}
+
+static void mainloop_run()
+{
+#ifdef HAVE_GLIB
+    g_main_loop_run(mainloop);
+#else
+    pa_mainloop_run(mainloop, NULL);
+#endif
+}
+
+static void mainloop_free()
+{
+#ifdef HAVE_GLIB
+    pa_glib_mainloop_free(pulse_mainloop);
+    g_main_loop_unref(mainloop);
+#else
+    pa_mainloop_free(mainloop);
+#endif
+}
 
 void quit(int retval)
 {
     returncode = retval;
-    pulse_quit();
+#ifdef HAVE_BLUEZ
+    bluez_quit();
+#endif
+    backend->quit();
+#ifdef HAVE_GLIB
     g_main_loop_quit(mainloop);
+#else
+    pa_mainloop_quit(mainloop, retval);
+#endif
 }
 
 static void signal_quit(pa_mainloop_api *api,
@@ -24,26 +145,706 @@ static void signal_quit(pa_mainloop_api *api,
     quit(0);
 }
 
+static void signal_stats(pa_mainloop_api *api,
+                         pa_signal_event *e,
+                         int sig, void *data)
+{
+    backend->stats();
+    if (config.perf)
+        perf_report("Main loop dispatch", &dispatch_perf);
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out,
+            "Usage: bluepulse [options]\n"
+            "  -B, --backend=BACKEND      pulse (default)"
+#ifdef HAVE_PIPEWIRE
+            " or pipewire"
+#endif
+            "\n"
+            "  -e, --engine=ENGINE        stream (default) or module\n"
+            "  -l, --module-latency=MSEC  module-loopback target latency\n"
+            "                             (default 100)\n"
+            "  -p, --profile=PROFILE      latency profile: low, normal\n"
+            "                             (default) or high\n"
+            "  -C, --codec=NAME=F/P/T     buffer NAME codec sources with\n"
+            "                             F ms fragments, P ms prebuffer and\n"
+            "                             a T ms target, or 'off' to use the\n"
+            "                             profile for all codecs\n"
+            "  -b, --backpressure=POLICY  none (default), drop-old, drop-new\n"
+            "                             or stretch\n"
+            "  -c, --catchup=MSEC         skip ahead when the sink queue is\n"
+            "                             longer than MSEC (default off)\n"
+            "  -t, --catchup-target=MSEC  queue length to skip back to\n"
+            "                             (default 100)\n"
+            "  -w, --watchdog=MSEC        recover streams that stop delivering\n"
+            "                             for MSEC (default 2000, 0 disables)\n"
+            "  -v, --volume=PERCENT       play at PERCENT of the source's\n"
+            "                             volume (default 100)\n"
+            "  -r, --resample=QUALITY     convert to the sink's native rate\n"
+            "                             in process: off (default), fast,\n"
+            "                             medium or best\n"
+            "  -a, --server=SERVER        connect to SERVER instead of the\n"
+            "                             default, repeat for several\n"
+            "  -d, --data-context         open a second connection for the\n"
+            "                             audio streams\n"
+            "  -m, --memory=KB            fit all stream buffers in KB,\n"
+            "                             refusing sources beyond that\n"
+            "  -S, --sink=SINK            play on SINK instead of the default,\n"
+            "                             repeat to play on several sinks\n"
+            "  -T, --tap=DIR              record what is played to WAV\n"
+            "                             files in DIR\n"
+            "  -M, --tap-match=TEXT       only record sources whose name or\n"
+            "                             description contains TEXT\n"
+            "  -x, --trace=FILE           record server events to FILE for\n"
+            "                             tools/replay\n"
+            "  -P, --perf                 count cycles, cache misses and CPU\n"
+            "                             time spent forwarding audio\n"
+            "  -f, --config=FILE          read options from FILE, and apply\n"
+            "                             changes to it while running\n"
+            "  -s, --state=FILE           remember loopbacks in FILE for a\n"
+            "                             fast restart\n"
+#ifdef HAVE_BLUEZ
+            "  -z, --bluez[=ADDRESS]      pre-arm devices as BlueZ connects\n"
+            "                             them, on the system bus or ADDRESS\n"
+#endif
+            "  -h, --help                 show this message\n");
+}
+
+static int parse_backend(const char *arg)
+{
+    unsigned int i;
+
+    for (i = 0; i < G_N_ELEMENTS(backends); i++) {
+        if (!strcmp(arg, backends[i]->name)) {
+            backend = backends[i];
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int parse_engine(const char *arg)
+{
+    if (!strcmp(arg, "stream"))
+        config.engine = ENGINE_STREAM;
+    else if (!strcmp(arg, "module"))
+        config.engine = ENGINE_MODULE;
+    else
+        return 1;
+
+    return 0;
+}
+
+static int parse_profile(const char *arg)
+{
+    unsigned int i;
+
+    for (i = 0; i < G_N_ELEMENTS(profiles); i++) {
+        if (!strcmp(arg, profiles[i].name)) {
+            config.profile = &profiles[i];
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int parse_backpressure(const char *arg)
+{
+    if (!strcmp(arg, "none"))
+        config.backpressure = BACKPRESSURE_NONE;
+    else if (!strcmp(arg, "drop-old"))
+        config.backpressure = BACKPRESSURE_DROP_OLD;
+    else if (!strcmp(arg, "drop-new"))
+        config.backpressure = BACKPRESSURE_DROP_NEW;
+    else if (!strcmp(arg, "stretch"))
+        config.backpressure = BACKPRESSURE_STRETCH;
+    else
+        return 1;
+
+    return 0;
+}
+
+static int parse_resample(const char *arg)
+{
+    if (!strcmp(arg, "off"))
+        config.resample = RESAMPLE_OFF;
+    else if (!strcmp(arg, "fast"))
+        config.resample = RESAMPLE_FAST;
+    else if (!strcmp(arg, "medium"))
+        config.resample = RESAMPLE_MEDIUM;
+    else if (!strcmp(arg, "best"))
+        config.resample = RESAMPLE_BEST;
+    else
+        return 1;
+
+    return 0;
+}
+
+static int parse_msec(const char *arg, unsigned int *msec)
+{
+    char *end;
+    unsigned long val;
+
+    val = strtoul(arg, &end, 10);
+    if (!*arg || *end || val > 60000)
+        return 1;
+
+    *msec = val;
+    return 0;
+}
+
+static int parse_kb(const char *arg, unsigned int *kb)
+{
+    char *end;
+    unsigned long val;
+
+    val = strtoul(arg, &end, 10);
+    if (!*arg || *end || !val || val > 1024 * 1024)
+        return 1;
+
+    *kb = val;
+    return 0;
+}
+
+static int parse_percent(const char *arg, unsigned int *percent)
+{
+    char *end;
+    unsigned long val;
+
+    val = strtoul(arg, &end, 10);
+    if (!*arg || *end || val > 150)
+        return 1;
+
+    *percent = val;
+    return 0;
+}
+
+static const struct option options[] = {
+    {"backend", required_argument, NULL, 'B'},
+    {"engine", required_argument, NULL, 'e'},
+    {"module-latency", required_argument, NULL, 'l'},
+    {"profile", required_argument, NULL, 'p'},
+    {"codec", required_argument, NULL, 'C'},
+    {"backpressure", required_argument, NULL, 'b'},
+    {"catchup", required_argument, NULL, 'c'},
+    {"catchup-target", required_argument, NULL, 't'},
+    {"watchdog", required_argument, NULL, 'w'},
+    {"volume", required_argument, NULL, 'v'},
+    {"resample", required_argument, NULL, 'r'},
+    {"server", required_argument, NULL, 'a'},
+    {"data-context", no_argument, NULL, 'd'},
+    {"memory", required_argument, NULL, 'm'},
+    {"sink", required_argument, NULL, 'S'},
+    {"tap", required_argument, NULL, 'T'},
+    {"tap-match", required_argument, NULL, 'M'},
+    {"trace", required_argument, NULL, 'x'},
+    {"perf", no_argument, NULL, 'P'},
+    {"config", required_argument, NULL, 'f'},
+    {"state", required_argument, NULL, 's'},
+#ifdef HAVE_BLUEZ
+    {"bluez", optional_argument, NULL, 'z'},
+#endif
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+static const char short_options[] =
+    "B:e:l:p:C:b:c:t:w:v:r:a:dm:S:T:M:x:Pf:s:z::h";
+
+/* When reloading, options that can't change on the fly are skipped */
+static int parse_option(int opt, const char *arg, int reload)
+{
+    if (reload && !strchr(RELOADABLE_OPTIONS, opt))
+        return 0;
+
+    switch (opt) {
+        case 'B':
+            if (parse_backend(arg)) {
+                fprintf(stderr, "Unknown backend: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 'e':
+            if (parse_engine(arg)) {
+                fprintf(stderr, "Invalid engine: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 'l':
+            if (parse_msec(arg, &config.module_latency_msec)) {
+                fprintf(stderr, "Invalid module latency: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 'p':
+            if (parse_profile(arg)) {
+                fprintf(stderr, "Unknown latency profile: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 'C':
+            if (!strcmp(arg, "off"))
+                config.codec_latency = 0;
+            else if (codec_parse(arg)) {
+                fprintf(stderr, "Invalid codec setting: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 'b':
+            if (parse_backpressure(arg)) {
+                fprintf(stderr, "Invalid backpressure policy: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 'c':
+            if (parse_msec(arg, &config.catchup_msec)) {
+                fprintf(stderr, "Invalid catch-up threshold: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 't':
+            if (parse_msec(arg, &config.catchup_target_msec)) {
+                fprintf(stderr, "Invalid catch-up target: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 'w':
+            if (parse_msec(arg, &config.watchdog_msec)) {
+                fprintf(stderr, "Invalid watchdog timeout: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 'v':
+            if (parse_percent(arg, &config.volume_percent)) {
+                fprintf(stderr, "Invalid volume: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 'r':
+            if (parse_resample(arg)) {
+                fprintf(stderr, "Invalid resampler quality: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 'a':
+            if (config.n_servers == MAX_SERVERS) {
+                fprintf(stderr, "At most %d servers are supported\n",
+                        MAX_SERVERS);
+                return 1;
+            }
+            config.servers[config.n_servers++] = arg;
+            break;
+
+        case 'd':
+            config.data_context = 1;
+            break;
+
+        case 'm':
+            if (parse_kb(arg, &config.memory_kb)) {
+                fprintf(stderr, "Invalid memory budget: %s\n", arg);
+                return 1;
+            }
+            break;
+
+        case 'S':
+            if (config.n_sinks == MAX_SINKS) {
+                fprintf(stderr, "At most %d sinks are supported\n",
+                        MAX_SINKS);
+                return 1;
+            }
+            config.sinks[config.n_sinks++] = arg;
+            break;
+
+        case 'T':
+            config.tap_dir = arg;
+            break;
+
+        case 'M':
+            config.tap_match = arg;
+            break;
+
+        case 'x':
+            trace_path = arg;
+            break;
+
+        case 'P':
+            config.perf = 1;
+            break;
+
+        case 'f':
+            /* already picked up, see parse_args() */
+            break;
+
+        case 's':
+            state_path = arg;
+            break;
+
+#ifdef HAVE_BLUEZ
+        case 'z':
+            bluez = 1;
+            bluez_address = arg;
+            break;
+#endif
+
+        default:
+            return 1;
+    }
+
+    return 0;
+}
+
+static const struct option* option_find(const char *name)
+{
+    const struct option *o;
+
+    for (o = options; o->name; o++) {
+        if (!strcmp(name, o->name))
+            return o;
+    }
+
+    return NULL;
+}
+
+/* One "name = value" per line, names as in the long options. Lines
+ * starting with # are comments. */
+static int parse_file(const char *path, int reload)
+{
+    char *line = NULL, *name, *value, *end, *fixed = NULL, *tmp;
+    const struct option *o;
+    unsigned int n = 0;
+    size_t size = 0;
+    int ret = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Can't read %s: %m\n", path);
+        return 1;
+    }
+
+    while (!ret && getline(&line, &size, f) >= 0) {
+        n++;
+        name = line + strspn(line, " \t");
+        end = name + strlen(name);
+        while (end > name && strchr(" \t\r\n", end[-1]))
+            *--end = '\0';
+        if (!*name || *name == '#')
+            continue;
+
+        value = name + strcspn(name, " \t=");
+        end = value;
+        value += strspn(value, " \t");
+        if (*value == '=')
+            value += 1 + strspn(value + 1, " \t");
+        *end = '\0';
+
+        o = option_find(name);
+        if (o == NULL || o->val == 'f' || o->val == 'h' ||
+                (o->has_arg == required_argument && !*value)) {
+            fprintf(stderr, "%s:%u: invalid option %s\n", path, n, name);
+            ret = 1;
+            break;
+        }
+        /* as getopt_long() would have it on the command line */
+        if (o->has_arg == no_argument && *value) {
+            fprintf(stderr, "%s:%u: option %s doesn't take a value\n",
+                    path, n, name);
+            ret = 1;
+            break;
+        }
+
+        /* startup options keep their values for good */
+        if (!strchr(RELOADABLE_OPTIONS, o->val)) {
+            if (asprintf(&tmp, "%s%s=%s\n", fixed ? fixed : "", name,
+                        value) < 0)
+                tmp = NULL;
+            free(fixed);
+            fixed = tmp;
+            if (!reload && *value)
+                value = strdup(value);
+        }
+
+        ret = parse_option(o->val, *value ? value : NULL, reload);
+        if (ret)
+            fprintf(stderr, "%s:%u: invalid option %s\n", path, n, name);
+    }
+
+    if (!reload)
+        config_fixed = fixed;
+    else {
+        if (!ret && strcmp(fixed ? fixed : "",
+                    config_fixed ? config_fixed : ""))
+            g_message("Some changes to %s only take effect on a restart",
+                    path);
+        free(fixed);
+    }
+
+    free(line);
+    fclose(f);
+    return ret;
+}
+
+static int check_config()
+{
+    if (config.catchup_msec &&
+            config.catchup_target_msec >= config.catchup_msec) {
+        fprintf(stderr, "Catch-up target must be below the threshold\n");
+        return 1;
+    }
+
+    if (config.n_sinks && (backend != &pulse_backend ||
+                config.engine != ENGINE_STREAM)) {
+        fprintf(stderr, "--sink needs the pulse backend's stream engine\n");
+        return 1;
+    }
+
+    if (config.n_servers && backend != &pulse_backend) {
+        fprintf(stderr, "--server needs the pulse backend\n");
+        return 1;
+    }
+
+    if (config.data_context && (backend != &pulse_backend ||
+                config.engine != ENGINE_STREAM)) {
+        fprintf(stderr,
+                "--data-context needs the pulse backend's stream engine\n");
+        return 1;
+    }
+
+    if (config.tap_match && !config.tap_dir) {
+        fprintf(stderr, "--tap-match needs --tap\n");
+        return 1;
+    }
+
+    if (config.tap_dir && (backend != &pulse_backend ||
+                config.engine != ENGINE_STREAM)) {
+        fprintf(stderr, "--tap needs the pulse backend's stream engine\n");
+        return 1;
+    }
+
+    if (trace_path && backend != &pulse_backend) {
+        fprintf(stderr, "--trace needs the pulse backend\n");
+        return 1;
+    }
+
+    if (config.memory_kb && (backend != &pulse_backend ||
+                config.engine != ENGINE_STREAM)) {
+        fprintf(stderr, "--memory needs the pulse backend's stream engine\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/* The config file first, then the command line so it wins */
+static int load_config(int reload)
+{
+    int opt;
+
+    if (config_path && parse_file(config_path, reload))
+        return 1;
+
+    optind = 0;
+    while ((opt = getopt_long(saved_argc, saved_argv, short_options,
+                    options, NULL)) != -1) {
+        if (parse_option(opt, optarg, reload))
+            return 1;
+    }
+
+    return check_config();
+}
+
+static int parse_args(int argc, char *argv[])
+{
+    int opt;
+
+    config = defaults;
+    /* remember the built in codec table */
+    codec_reset();
+
+    /* only look for --config and mistakes on the first pass */
+    while ((opt = getopt_long(argc, argv, short_options, options,
+                    NULL)) != -1) {
+        switch (opt) {
+            case 'f':
+                config_path = optarg;
+                break;
+
+            case 'h':
+                usage(stdout);
+                exit(0);
+
+            case '?':
+                usage(stderr);
+                return 1;
+        }
+    }
+
+    saved_argc = argc;
+    saved_argv = argv;
+    return load_config(0);
+}
+
+/* Read the options again and hand what changed to the backend. Only
+ * the reloadable ones are looked at, see RELOADABLE_OPTIONS. */
+static void config_reload()
+{
+    pa_usec_t start = pa_rtclock_now();
+    struct config old = config;
+    struct codec *table;
+
+    table = malloc(sizeof(*table) * n_codecs);
+    memcpy(table, codecs, sizeof(*table) * n_codecs);
+
+    config.profile = defaults.profile;
+    config.codec_latency = defaults.codec_latency;
+    config.backpressure = defaults.backpressure;
+    config.catchup_msec = defaults.catchup_msec;
+    config.catchup_target_msec = defaults.catchup_target_msec;
+    config.watchdog_msec = defaults.watchdog_msec;
+    config.volume_percent = defaults.volume_percent;
+    codec_reset();
+
+    if (load_config(1)) {
+        g_warning("Keeping the running configuration");
+        config = old;
+        memcpy(codecs, table, sizeof(*table) * n_codecs);
+    }
+    else if (backend->reload)
+        backend->reload(&old, start);
+    else
+        g_message("Configuration reloaded, loopbacks started from now on "
+                "will use it");
+
+    free(table);
+}
+
+/* Editors tend to write a new file and rename it over the old one,
+ * so the directory is watched rather than the file */
+static void config_changed(pa_mainloop_api *api, pa_io_event *e, int fd,
+        pa_io_event_flags_t events, void *data)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *name = strrchr(config_path, '/');
+    const struct inotify_event *ev;
+    int changed = 0;
+    ssize_t len;
+    char *p;
+
+    name = name ? name + 1 : config_path;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event*)p;
+            if (ev->len && !strcmp(ev->name, name))
+                changed = 1;
+        }
+    }
+
+    if (changed)
+        config_reload();
+}
+
+static void config_watch()
+{
+    const char *slash = strrchr(config_path, '/');
+    char *dir;
+
+    if (slash == NULL)
+        dir = strdup(".");
+    else if (slash == config_path)
+        dir = strdup("/");
+    else
+        dir = strndup(config_path, slash - config_path);
+
+    config_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (config_fd < 0 || inotify_add_watch(config_fd, dir,
+                IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        g_warning("Can't watch %s for changes: %m", config_path);
+        if (config_fd >= 0)
+            close(config_fd);
+        config_fd = -1;
+    }
+    else {
+        config_io = pulse_api->io_new(pulse_api, config_fd,
+                PA_IO_EVENT_INPUT, config_changed, NULL);
+    }
+
+    free(dir);
+}
+
+static void signal_reload(pa_mainloop_api *api,
+                          pa_signal_event *e,
+                          int sig, void *data)
+{
+    config_reload();
+}
+
 int main(int argc, char *argv[])
 {
-    mainloop = g_main_loop_new(NULL, FALSE);
-    pulse_mainloop = pa_glib_mainloop_new(NULL);
-    pulse_api = pa_glib_mainloop_get_api(pulse_mainloop);
+    if (parse_args(argc, argv))
+        return 1;
+
+    mainloop_new();
 
     pa_signal_init(pulse_api);
     pa_signal_new(SIGINT, signal_quit, NULL);
     pa_signal_new(SIGTERM, signal_quit, NULL);
+    pa_signal_new(SIGUSR1, signal_stats, NULL);
+    pa_signal_new(SIGHUP, signal_reload, NULL);
 
-    if (pulse_init(pulse_api))
+    if (state_path && state_open(state_path))
         goto finish;
 
-    g_main_loop_run(mainloop);
+    if (trace_path && trace_open(trace_path,
+                config.n_servers ? config.n_servers : 1))
+        goto finish;
+
+    if (config.perf) {
+        perf_init();
+        mainloop_perf();
+    }
+
+    if (backend->init(pulse_api))
+        goto finish;
+
+#ifdef HAVE_BLUEZ
+    if (bluez && bluez_init(bluez_address, backend)) {
+        backend->quit();
+        goto finish;
+    }
+#endif
+
+    if (config_path)
+        config_watch();
+
+    mainloop_run();
 
 finish:
+    if (config_io)
+        pulse_api->io_free(config_io);
+    if (config_fd >= 0)
+        close(config_fd);
+    trace_close();
+    state_close();
+    perf_quit();
     pa_signal_done();
 
-    pa_glib_mainloop_free(pulse_mainloop);
-    g_main_loop_unref(mainloop);
+    mainloop_free();
 
     return returncode;
 }
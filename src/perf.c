@@ -0,0 +1,156 @@
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <pulse/pulseaudio.h>
+
+#include "log.h"
+#include "bluepulse.h"
+
+/* Hardware counters for this thread, read as one group so a sample
+ * costs a single read(). Where perf_event_open isn't allowed, or there
+ * is no PMU as in most VMs, only the CPU time is measured. */
+
+enum {
+    COUNTER_CYCLES,
+    COUNTER_CACHE_MISSES,
+    COUNTER_CONTEXT_SWITCHES,
+    N_COUNTERS,
+};
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} counters[N_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+static int fds[N_COUNTERS] = {-1, -1, -1};
+
+static int perf_open(unsigned int i, int group, int exclude_kernel)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[i].type;
+    attr.config = counters[i].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = exclude_kernel;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void perf_close()
+{
+    unsigned int i;
+
+    for (i = 0; i < N_COUNTERS; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+/* Returns 1 if only the CPU time will be available */
+int perf_init()
+{
+    int exclude_kernel = 0;
+    unsigned int i;
+
+    fds[0] = perf_open(0, -1, exclude_kernel);
+    /* perf_event_paranoid 2 allows user space counting only */
+    if (fds[0] < 0 && errno == EACCES)
+        fds[0] = perf_open(0, -1, exclude_kernel = 1);
+
+    for (i = 1; fds[0] >= 0 && i < N_COUNTERS; i++) {
+        fds[i] = perf_open(i, fds[0], exclude_kernel);
+        if (fds[i] < 0)
+            break;
+    }
+
+    if (fds[0] < 0 || i < N_COUNTERS) {
+        g_message("Performance counters unavailable (%s), measuring CPU "
+                "time only", strerror(errno));
+        perf_close();
+        return 1;
+    }
+
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+}
+
+void perf_quit()
+{
+    perf_close();
+}
+
+void perf_read(struct perf_counts *c)
+{
+    struct timespec ts;
+    uint64_t values[1 + N_COUNTERS];
+
+    if (fds[0] >= 0 && read(fds[0], values, sizeof(values)) ==
+            sizeof(values)) {
+        c->cycles = values[1 + COUNTER_CYCLES];
+        c->cache_misses = values[1 + COUNTER_CACHE_MISSES];
+        c->context_switches = values[1 + COUNTER_CONTEXT_SWITCHES];
+    }
+    else
+        c->cycles = c->cache_misses = c->context_switches = 0;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    c->nsec = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Add what was spent since start on bytes of audio */
+void perf_add(struct perf_stats *s, const struct perf_counts *start,
+        size_t bytes)
+{
+    struct perf_counts now;
+
+    perf_read(&now);
+    s->total.cycles += now.cycles - start->cycles;
+    s->total.cache_misses += now.cache_misses - start->cache_misses;
+    s->total.context_switches +=
+        now.context_switches - start->context_switches;
+    s->total.nsec += now.nsec - start->nsec;
+    s->bytes += bytes;
+    s->samples++;
+}
+
+/* Costs per kB of audio, or per call when no bytes were counted */
+void perf_report(const char *what, const struct perf_stats *s)
+{
+    double per = s->bytes ? s->bytes / 1024.0 : s->samples;
+    const char *unit = s->bytes ? "kB" : "call";
+
+    if (!s->samples)
+        return;
+
+    if (fds[0] < 0) {
+        g_message("%s: %lu calls, %.2f us CPU per %s", what, s->samples,
+                s->total.nsec / 1000.0 / per, unit);
+        return;
+    }
+
+    if (s->bytes)
+        g_message("%s: %lu calls, %.1f cycles per byte", what, s->samples,
+                (double)s->total.cycles / s->bytes);
+    else
+        g_message("%s: %lu calls, %.0f cycles per call", what, s->samples,
+                s->total.cycles / per);
+    g_message("%s: %.2f cache misses, %.3f context switches and %.2f us "
+            "CPU per %s", what, s->total.cache_misses / per,
+            s->total.context_switches / per,
+            s->total.nsec / 1000.0 / per, unit);
+}
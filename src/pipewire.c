@@ -0,0 +1,528 @@
+#include <errno.h>
+#include <string.h>
+#include <pulse/pulseaudio.h>
+#include <pipewire/pipewire.h>
+#include <pipewire/extensions/metadata.h>
+#include <spa/utils/json.h>
+#include <ccan/list/list.h>
+
+#include "log.h"
+#include "bluepulse.h"
+
+/* Native PipeWire backend: A2DP source nodes are linked port by port
+ * to the default sink in the graph, no audio passes through us. */
+
+struct sink {
+    uint32_t id;
+    char *name;
+    struct list_node list;
+};
+
+struct port {
+    uint32_t id;
+    uint32_t node_id;
+    int output;
+    char *channel;
+    struct list_node list;
+};
+
+struct link {
+    uint32_t output_port;
+    uint32_t input_port;
+    struct pw_proxy *proxy;
+    struct list_node list;
+};
+
+struct loopback {
+    uint32_t source_id;
+    char *description;
+    struct list_head links;
+    struct list_node list;
+};
+
+static struct pw_loop *loop;
+static struct pw_context *pw_context;
+static struct pw_core *core;
+static struct pw_registry *registry;
+static struct pw_metadata *metadata;
+static struct spa_hook core_listener;
+static struct spa_hook registry_listener;
+static struct spa_hook metadata_listener;
+static pa_mainloop_api *mainloop_api;
+static pa_io_event *loop_event;
+/* set from within the PipeWire loop, acted on once it returns */
+static int disconnected;
+
+static LIST_HEAD(sinks);
+static LIST_HEAD(ports);
+static LIST_HEAD(loops);
+static uint32_t sink_id = SPA_ID_INVALID;
+static char *sink_name;
+
+static struct loopback* loopback_get(uint32_t source_id)
+{
+    struct loopback *l;
+
+    list_for_each(&loops, l, list) {
+        if (l->source_id == source_id)
+            return l;
+    }
+
+    return NULL;
+}
+
+static void loopback_unlink(struct loopback *l)
+{
+    struct link *k, *n;
+
+    list_for_each_safe(&l->links, k, n, list) {
+        list_del(&k->list);
+        pw_proxy_destroy(k->proxy);
+        free(k);
+    }
+}
+
+static int link_exists(struct loopback *l, uint32_t output, uint32_t input)
+{
+    struct link *k;
+
+    list_for_each(&l->links, k, list) {
+        if (k->output_port == output && k->input_port == input)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int channel_match(const struct port *out, const struct port *in)
+{
+    if (!out->channel || !in->channel)
+        return 1;
+
+    if (!strcmp(out->channel, "MONO") || !strcmp(in->channel, "MONO"))
+        return 1;
+
+    return !strcmp(out->channel, in->channel);
+}
+
+/* Create whatever port links are missing between the source and sink,
+ * called again as ports show up since they trail their node. */
+static void loopback_link(struct loopback *l)
+{
+    struct pw_properties *props;
+    struct port *out, *in;
+    struct link *k;
+
+    if (sink_id == SPA_ID_INVALID)
+        return;
+
+    list_for_each(&ports, out, list) {
+        if (out->node_id != l->source_id || !out->output)
+            continue;
+
+        list_for_each(&ports, in, list) {
+            if (in->node_id != sink_id || in->output)
+                continue;
+
+            if (!channel_match(out, in) || link_exists(l, out->id, in->id))
+                continue;
+
+            props = pw_properties_new(PW_KEY_OBJECT_LINGER, "false", NULL);
+            pw_properties_setf(props, PW_KEY_LINK_OUTPUT_NODE,
+                    "%u", l->source_id);
+            pw_properties_setf(props, PW_KEY_LINK_OUTPUT_PORT, "%u", out->id);
+            pw_properties_setf(props, PW_KEY_LINK_INPUT_NODE, "%u", sink_id);
+            pw_properties_setf(props, PW_KEY_LINK_INPUT_PORT, "%u", in->id);
+
+            k = calloc(1, sizeof(*k));
+            k->output_port = out->id;
+            k->input_port = in->id;
+            k->proxy = pw_core_create_object(core, "link-factory",
+                    PW_TYPE_INTERFACE_Link, PW_VERSION_LINK,
+                    &props->dict, 0);
+            pw_properties_free(props);
+
+            if (k->proxy == NULL) {
+                g_warning("Failed to link %s: %s", l->description,
+                        strerror(errno));
+                free(k);
+                continue;
+            }
+
+            list_add(&l->links, &k->list);
+        }
+    }
+}
+
+static void loopback_relink_all()
+{
+    struct loopback *l;
+
+    list_for_each(&loops, l, list) {
+        loopback_unlink(l);
+        loopback_link(l);
+    }
+}
+
+static void loopback_stop(struct loopback *l)
+{
+    g_message("Removed A2DP Source: %s", l->description);
+    list_del(&l->list);
+    loopback_unlink(l);
+    free(l->description);
+    free(l);
+}
+
+static void loopback_stop_all()
+{
+    struct loopback *l, *n;
+
+    list_for_each_safe(&loops, l, n, list)
+        loopback_stop(l);
+}
+
+static void loopback_start(uint32_t id, const struct spa_dict *props)
+{
+    struct loopback *l;
+    const char *desc;
+
+    desc = spa_dict_lookup(props, PW_KEY_NODE_DESCRIPTION);
+    if (desc == NULL)
+        desc = spa_dict_lookup(props, PW_KEY_NODE_NAME);
+
+    l = calloc(1, sizeof(*l));
+    l->source_id = id;
+    l->description = strdup(desc ? desc : "unknown");
+    list_head_init(&l->links);
+    list_add(&loops, &l->list);
+
+    g_message("New A2DP Source: %s", l->description);
+    loopback_link(l);
+}
+
+static int source_props_match(const struct spa_dict *props)
+{
+    const char *class, *profile;
+
+    class = spa_dict_lookup(props, PW_KEY_MEDIA_CLASS);
+    if (class == NULL || strcmp(class, "Audio/Source"))
+        return 0;
+
+    profile = spa_dict_lookup(props, "api.bluez5.profile");
+    if (profile == NULL)
+        return 0;
+
+    return !strcmp(profile, "a2dp-source");
+}
+
+/* Point all loopbacks at the sink named by the default metadata */
+static void sink_update()
+{
+    uint32_t id = SPA_ID_INVALID;
+    struct sink *k;
+
+    list_for_each(&sinks, k, list) {
+        if (sink_name && !strcmp(k->name, sink_name))
+            id = k->id;
+    }
+
+    if (id == sink_id)
+        return;
+
+    sink_id = id;
+    loopback_relink_all();
+}
+
+static void sink_found(uint32_t id, const struct spa_dict *props)
+{
+    const char *class, *name;
+    struct sink *k;
+
+    class = spa_dict_lookup(props, PW_KEY_MEDIA_CLASS);
+    if (class == NULL || strcmp(class, "Audio/Sink"))
+        return;
+
+    name = spa_dict_lookup(props, PW_KEY_NODE_NAME);
+    if (name == NULL)
+        return;
+
+    k = calloc(1, sizeof(*k));
+    k->id = id;
+    k->name = strdup(name);
+    list_add(&sinks, &k->list);
+
+    sink_update();
+}
+
+static void sink_free_all()
+{
+    struct sink *k, *n;
+
+    list_for_each_safe(&sinks, k, n, list) {
+        list_del(&k->list);
+        free(k->name);
+        free(k);
+    }
+}
+
+static void port_found(uint32_t id, const struct spa_dict *props)
+{
+    const char *node, *dir, *channel, *monitor;
+    struct loopback *l;
+    struct port *p;
+
+    node = spa_dict_lookup(props, PW_KEY_NODE_ID);
+    dir = spa_dict_lookup(props, PW_KEY_PORT_DIRECTION);
+    if (node == NULL || dir == NULL)
+        return;
+
+    /* Don't feed sink monitor ports into anything */
+    monitor = spa_dict_lookup(props, PW_KEY_PORT_MONITOR);
+    if (monitor && !strcmp(monitor, "true"))
+        return;
+
+    channel = spa_dict_lookup(props, PW_KEY_AUDIO_CHANNEL);
+
+    p = calloc(1, sizeof(*p));
+    p->id = id;
+    p->node_id = atoi(node);
+    p->output = !strcmp(dir, "out");
+    p->channel = channel ? strdup(channel) : NULL;
+    list_add(&ports, &p->list);
+
+    if (p->output) {
+        l = loopback_get(p->node_id);
+        if (l != NULL)
+            loopback_link(l);
+    }
+    else if (p->node_id == sink_id) {
+        list_for_each(&loops, l, list)
+            loopback_link(l);
+    }
+}
+
+static int default_sink(void *data, uint32_t subject, const char *key,
+        const char *type, const char *value)
+{
+    struct spa_json it[2];
+    char k[64], name[256];
+
+    if (subject != PW_ID_CORE || key == NULL ||
+            strcmp(key, "default.audio.sink"))
+        return 0;
+
+    free(sink_name);
+    sink_name = NULL;
+
+    if (value != NULL) {
+        spa_json_init(&it[0], value, strlen(value));
+        if (spa_json_enter_object(&it[0], &it[1]) > 0) {
+            while (spa_json_get_string(&it[1], k, sizeof(k)) > 0) {
+                if (strcmp(k, "name")) {
+                    const char *v;
+                    if (spa_json_next(&it[1], &v) <= 0)
+                        break;
+                    continue;
+                }
+                if (spa_json_get_string(&it[1], name, sizeof(name)) > 0)
+                    sink_name = strdup(name);
+                break;
+            }
+        }
+    }
+
+    sink_update();
+    return 0;
+}
+
+static const struct pw_metadata_events metadata_events = {
+    PW_VERSION_METADATA_EVENTS,
+    .property = default_sink,
+};
+
+static void registry_global(void *data, uint32_t id, uint32_t permissions,
+        const char *type, uint32_t version, const struct spa_dict *props)
+{
+    const char *name;
+
+    if (props == NULL)
+        return;
+
+    if (!strcmp(type, PW_TYPE_INTERFACE_Port)) {
+        port_found(id, props);
+    }
+    else if (!strcmp(type, PW_TYPE_INTERFACE_Node)) {
+        if (source_props_match(props)) {
+            if (loopback_get(id) == NULL)
+                loopback_start(id, props);
+        }
+        else
+            sink_found(id, props);
+    }
+    else if (!strcmp(type, PW_TYPE_INTERFACE_Metadata) && !metadata) {
+        name = spa_dict_lookup(props, PW_KEY_METADATA_NAME);
+        if (name == NULL || strcmp(name, "default"))
+            return;
+
+        metadata = pw_registry_bind(registry, id, type,
+                PW_VERSION_METADATA, 0);
+        pw_metadata_add_listener(metadata, &metadata_listener,
+                &metadata_events, NULL);
+    }
+}
+
+static void registry_global_remove(void *data, uint32_t id)
+{
+    struct loopback *l;
+    struct sink *s, *sn;
+    struct port *p, *n;
+    struct link *k, *kn;
+
+    l = loopback_get(id);
+    if (l != NULL) {
+        loopback_stop(l);
+        return;
+    }
+
+    list_for_each_safe(&sinks, s, sn, list) {
+        if (s->id != id)
+            continue;
+        list_del(&s->list);
+        free(s->name);
+        free(s);
+        sink_update();
+        return;
+    }
+
+    list_for_each_safe(&ports, p, n, list) {
+        if (p->id != id)
+            continue;
+
+        /* The server has dropped any links on the port already */
+        list_for_each(&loops, l, list) {
+            list_for_each_safe(&l->links, k, kn, list) {
+                if (k->output_port != id && k->input_port != id)
+                    continue;
+                list_del(&k->list);
+                pw_proxy_destroy(k->proxy);
+                free(k);
+            }
+        }
+
+        list_del(&p->list);
+        free(p->channel);
+        free(p);
+    }
+}
+
+static const struct pw_registry_events registry_events = {
+    PW_VERSION_REGISTRY_EVENTS,
+    .global = registry_global,
+    .global_remove = registry_global_remove,
+};
+
+static void core_error(void *data, uint32_t id, int seq,
+        int res, const char *message)
+{
+    g_warning("PipeWire error: %s", message);
+
+    /* Lost the connection, let whatever supervises us restart things.
+     * The loop is still iterating, it can't be torn down from here. */
+    if (id == PW_ID_CORE && res == -EPIPE)
+        disconnected = 1;
+}
+
+static const struct pw_core_events core_events = {
+    PW_VERSION_CORE_EVENTS,
+    .error = core_error,
+};
+
+static void loop_ready(pa_mainloop_api *api, pa_io_event *e, int fd,
+        pa_io_event_flags_t events, void *data)
+{
+    pw_loop_iterate(loop, 0);
+    if (disconnected)
+        quit(1);
+}
+
+static int pipewire_init(pa_mainloop_api *api)
+{
+    pw_init(NULL, NULL);
+
+    loop = pw_loop_new(NULL);
+    pw_context = pw_context_new(loop, NULL, 0);
+    g_assert(loop && pw_context);
+
+    core = pw_context_connect(pw_context,
+            pw_properties_new(PW_KEY_APP_NAME, APPLICATION_NAME, NULL), 0);
+    if (core == NULL) {
+        g_warning("Connection failure: %s", strerror(errno));
+        pw_context_destroy(pw_context);
+        pw_loop_destroy(loop);
+        return 1;
+    }
+
+    pw_core_add_listener(core, &core_listener, &core_events, NULL);
+    registry = pw_core_get_registry(core, PW_VERSION_REGISTRY, 0);
+    pw_registry_add_listener(registry, &registry_listener,
+            &registry_events, NULL);
+
+    /* Drive the PipeWire loop from ours */
+    pw_loop_enter(loop);
+    mainloop_api = api;
+    loop_event = api->io_new(api, pw_loop_get_fd(loop),
+            PA_IO_EVENT_INPUT, loop_ready, NULL);
+
+    return 0;
+}
+
+static void pipewire_quit()
+{
+    struct port *p, *n;
+
+    if (core == NULL)
+        return;
+
+    loopback_stop_all();
+    sink_free_all();
+    list_for_each_safe(&ports, p, n, list) {
+        list_del(&p->list);
+        free(p->channel);
+        free(p);
+    }
+
+    if (metadata)
+        pw_proxy_destroy((struct pw_proxy*)metadata);
+    pw_proxy_destroy((struct pw_proxy*)registry);
+    pw_core_disconnect(core);
+    core = NULL;
+
+    pw_loop_leave(loop);
+    mainloop_api->io_free(loop_event);
+    pw_context_destroy(pw_context);
+    pw_loop_destroy(loop);
+    free(sink_name);
+    pw_deinit();
+}
+
+static void pipewire_stats()
+{
+    struct loopback *l;
+    struct link *k;
+    unsigned int n;
+
+    list_for_each(&loops, l, list) {
+        n = 0;
+        list_for_each(&l->links, k, list)
+            n++;
+        g_message("%s: node %u, %u port links", l->description,
+                l->source_id, n);
+    }
+}
+
+const struct backend pipewire_backend = {
+    .name = "pipewire",
+    .init = pipewire_init,
+    .quit = pipewire_quit,
+    .stats = pipewire_stats,
+};
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pulse/pulseaudio.h>
+
+#include "bluepulse.h"
+
+/* Shared by the daemon and module-bluepulse, keep this libpulse only */
+
+int source_match(pa_proplist *p)
+{
+    const char *proto;
+
+    proto = pa_proplist_gets(p, "bluetooth.protocol");
+    if (proto == NULL)
+        return 0;
+
+    return !strcmp("a2dp_source", proto);
+}
+
+char *loopback_module_args(const char *source,
+        unsigned int latency_msec, unsigned int threshold_msec)
+{
+    char *args, threshold[64] = "";
+
+    /* fast_adjust_threshold_msec requires PulseAudio 13 */
+    if (threshold_msec)
+        snprintf(threshold, sizeof(threshold),
+                " fast_adjust_threshold_msec=%u", threshold_msec);
+
+    if (asprintf(&args, "source=%s source_dont_move=true "
+                "latency_msec=%u adjust_time=%u%s "
+                "sink_input_properties=\"" MODULE_TAG "\" "
+                "source_output_properties=\"" MODULE_TAG "\"",
+                source, latency_msec, MODULE_ADJUST_SEC, threshold) < 0)
+        return NULL;
+
+    return args;
+}
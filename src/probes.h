@@ -0,0 +1,21 @@
+#ifndef BLUEPULSE_PROBES_H
+#define BLUEPULSE_PROBES_H
+
+/* USDT probes for bpftrace and other tracers, built in with make SDT=1
+ * (needs sys/sdt.h from systemtap). Each probe compiles to a single nop
+ * that a tracer patches when it attaches. Without SDT the arguments are
+ * not even evaluated. The .bt files in scripts/ are examples. */
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(bluepulse, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(bluepulse, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(bluepulse, name, a, b, c)
+#else
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
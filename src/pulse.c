@@ -1,31 +1,277 @@
-#include <glib.h>
 #include <time.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <pulse/pulseaudio.h>
 #include <ccan/list/list.h>
 
+#include "log.h"
+#include "probes.h"
 #include "bluepulse.h"
 
 /* Alias this because it is used constantly */
 #define pao(o) pa_operation_unref(o)
 
+/* Rate boost applied to the sink when the stretch policy is active */
+#define STRETCH_PERCENT 2
+
+/* Length of the crossfade hiding a catch-up jump */
+#define CROSSFADE_MSEC 5
+
+/* Underruns this soon after the first audio count as startup underruns */
+#define STARTUP_MSEC 5000
+
+/* How often the sinks of a fan-out are compared, and how far apart
+ * they may drift before their rates are trimmed by ALIGN_PERMILLE */
+#define ALIGN_MSEC 1000
+#define ALIGN_TOLERANCE_USEC 2000
+#define ALIGN_PERMILLE 5
+
+/* NEW source events that arrive within this long of the previous
+ * lookup are batched into a single source list request */
+#define BURST_MSEC 30
+
+/* With a memory budget, sink streams get up to this many times their
+ * target length as maxlength, and never less than the target length */
+#define MAXLENGTH_FACTOR 4
+
+/* Steps taken in turn, one per watchdog timeout, for a record stream
+ * that stopped delivering while its source is running */
+enum recovery {
+    RECOVERY_NONE,
+    RECOVERY_FLUSH,
+    RECOVERY_RECONNECT,     /* only the record stream */
+    RECOVERY_REBUILD,       /* the whole loopback */
+    RECOVERY_GIVEN_UP,
+};
+
+static const char *recovery_names[] = {
+    "none", "flush", "reconnect", "rebuild", "giving up",
+};
+
+/* Steps from a device appearing to its audio playing, timed for each
+ * loopback started for a new source */
+enum milestone {
+    MILESTONE_EVENT,            /* NEW source event */
+    MILESTONE_INFO,             /* source info reply */
+    MILESTONE_RECORD_READY,
+    MILESTONE_SINKS_READY,      /* the last of them */
+    MILESTONE_FIRST_READ,
+    MILESTONE_FIRST_AUDIO,      /* the first sink started playing */
+    N_MILESTONES,
+};
+
+static const char *milestone_names[] = {
+    "event", "info", "record ready", "sinks ready", "first read",
+    "first audio",
+};
+
+/* Connects kept for the percentiles, the oldest are dropped */
+#define TTFA_SAMPLES 256
+
+/* NEW events remembered until their source is looked up */
+#define NEW_EVENTS 32
+
+/* Record data copied once and shared by every sink stream it goes to */
+struct fragment {
+    unsigned int refs;
+    uint8_t data[];
+};
+
+/* One sink a loopback plays on, there are several with --sink */
+struct output {
+    struct loopback *loop;
+    const char *device;         /* NULL for the default sink */
+    pa_stream *sink;
+    uint32_t serial;            /* of the sink stream, for --trace */
+    int stretched;
+    int trim;                   /* -1, 0 or 1 times ALIGN_PERMILLE */
+    uint64_t dropped_bytes;
+    /* discarded before the stream was ready, not backpressure */
+    uint64_t early_bytes;
+    /* stays corked until prebuf bytes have been written */
+    int corked;
+    size_t prebuffered;
+    pa_usec_t ttfa_usec, first_audio_usec;
+    unsigned int underruns, startup_underruns;
+};
+
+/* One PulseAudio server and everything we do on it, there are
+ * several when --server is given more than once */
+struct server {
+    unsigned int id;            /* position on the command line */
+    const char *address;        /* NULL for the default server */
+    pa_context *context;
+    /* a second connection for the streams, with --data-context */
+    pa_context *data;
+    struct list_head loops;
+    struct list_head prearms;
+    /* native rate of the default sink, what --resample converts to */
+    uint32_t sink_rate;
+    /* sources turned away until some of the memory budget is freed */
+    unsigned int refused;
+    /* reconnect attempts continue until then */
+    pa_time_event *retry;
+    time_t retry_until;
+    /* when recent NEW source events arrived */
+    struct {
+        uint32_t idx;
+        pa_usec_t usec;
+    } news[NEW_EVENTS];
+    unsigned int next_new;
+    /* NEW source events waiting for the burst window to close */
+    uint32_t *burst;
+    unsigned int n_burst, burst_size;
+    pa_time_event *burst_timer;
+    struct list_node list;
+};
+
+/* Sources a batched source list request was made for */
+struct burst {
+    unsigned int n;
+    uint32_t idx[];
+};
+
 struct loopback {
+    struct server *server;
     uint32_t source_idx;
+    uint32_t module_idx;
     pa_stream *source;
-    pa_stream *sink;
+    uint32_t source_serial;
+    struct output outputs[MAX_SINKS];
+    unsigned int n_outputs;
+    /* set once the outputs have been padded to the same latency */
+    int aligned;
+    pa_time_event *align_timer;
+    pa_sample_spec spec;
+    /* what the sinks are fed, differs from spec when resampling */
+    pa_sample_spec sink_spec;
+    struct resampler *resampler;
+    char *source_name;
     char *description;
+    /* buffering comes from the codec table if the codec is known */
+    struct codec *codec;
+    struct latency_profile latency;
+    /* catch-up state, tail holds the last bytes written to the sinks */
+    size_t skip;
+    int fade;
+    uint8_t *tail;
+    size_t tail_len, tail_size;
+    unsigned int catchups;
+    uint64_t skipped_bytes;
+    /* a new stream pair being brought up after a format change */
+    struct loopback *replacement;
+    struct loopback *replacing;
+    /* stream maxlength and bytes held against the memory budget */
+    uint32_t maxlength;
+    size_t reserved;
+    size_t prebuf;
+    pa_usec_t start_usec;
+    /* set from the info reply on for new sources, 0 if not reached */
+    pa_usec_t milestones[N_MILESTONES];
+    /* stall watchdog, armed by the first read */
+    pa_time_event *watchdog;
+    pa_usec_t last_read_usec;
+    /* how far reads stray from the pace of the audio they carry */
+    size_t last_read_len;
+    pa_usec_t jitter_usec, jitter_max;
+    unsigned long jitter_reads;
+    pa_usec_t stall_usec, step_usec;
+    enum recovery recovery;
+    /* recording of what is played, with --tap */
+    struct tap *tap;
+    /* cost of loopback_read(), with --perf */
+    struct perf_stats perf;
+    /* saved copy in the state file, restored ones are unverified */
+    struct state_entry *state;
+    int restored;
+    struct list_node list;
+};
+
+/* A sink stream opened ahead of time for a device that is connecting */
+struct prearm {
+    struct server *server;
+    char device[18];
+    /* what the sink was sized for, the codec's if BlueZ named it */
+    struct latency_profile latency;
+    pa_stream *sink;
+    uint32_t serial;
     struct list_node list;
 };
 
-static pa_context *context;
-static LIST_HEAD(loops);
+/* What a pre-armed sink is opened with, the usual SBC configuration */
+static const pa_sample_spec prearm_spec = {PA_SAMPLE_S16LE, 44100, 2};
+
+static pa_mainloop_api *mainloop_api;
+static LIST_HEAD(servers);
+/* the memory budget is shared by all servers */
+static size_t memory_used;
+static unsigned int refused_total, degraded_total;
+/* streams created so far, how the trace tells them apart */
+static uint32_t stream_serial;
 
-static struct loopback* loopback_get(uint32_t source_idx)
+/* Stalls detected, and what brought them back */
+static struct {
+    unsigned int stalls;
+    unsigned int recovered[RECOVERY_GIVEN_UP + 1];
+    pa_usec_t detect_usec, detect_max;
+    pa_usec_t recover_usec, recover_max;
+} watchdog;
+
+/* NEW source events, those a REMOVE cancelled before they were looked
+ * up, and the lookups made for the rest */
+static struct {
+    unsigned int events, cancelled, lookups;
+} bursts;
+
+/* Milestones of the latest connects, as usec since the event or, when
+ * that wasn't seen, the info reply. -1 where a step wasn't timed. */
+static struct {
+    pa_usec_t samples[TTFA_SAMPLES][N_MILESTONES];
+    unsigned int n;
+    unsigned int with_event, never_played;
+} ttfa;
+
+/* Config reloads, timed from reading the file until the server has
+ * acknowledged every change. Only the latest one is waited for. */
+static struct {
+    unsigned int count, generation;
+    unsigned int pending, failed;
+    pa_usec_t start_usec;
+    pa_usec_t last_usec, total_usec, max_usec;
+} reload;
+
+static struct server* server_get(pa_context *c)
+{
+    struct server *s;
+
+    list_for_each(&servers, s, list) {
+        if (s->context == c)
+            return s;
+    }
+
+    g_assert_not_reached();
+}
+
+/* Where streams go, kept apart from introspection if asked to */
+static pa_context* server_streams(struct server *s)
+{
+    return s->data ? s->data : s->context;
+}
+
+static const char* server_name(struct server *s)
+{
+    return s->address ? s->address : "default server";
+}
+
+static void server_reconnect(struct server *s);
+static void server_stop(struct server *s);
+
+static struct loopback* loopback_get(struct server *s, uint32_t source_idx)
 {
     struct loopback *l;
 
-    list_for_each(&loops, l, list) {
+    list_for_each(&s->loops, l, list) {
         if (l->source_idx == source_idx)
             return l;
     }
@@ -33,107 +279,1650 @@ static struct loopback* loopback_get(uint32_t source_idx)
     return NULL;
 }
 
-static void loopback_stop(struct loopback* l)
+static struct loopback* loopback_find(struct server *s,
+        const char *source_name)
 {
-    g_message("Removed A2DP Source: %s", l->description);
-    list_del(&l->list);
-    pa_stream_disconnect(l->source);
-    pa_stream_disconnect(l->sink);
-    pa_stream_unref(l->source);
-    pa_stream_unref(l->sink);
+    struct loopback *l;
+
+    list_for_each(&s->loops, l, list) {
+        if (!strcmp(l->source_name, source_name))
+            return l;
+    }
+
+    return NULL;
+}
+
+/* When the NEW event for a source arrived, 0 if it wasn't seen */
+static pa_usec_t source_new_usec(struct server *s, uint32_t idx)
+{
+    pa_usec_t usec;
+    unsigned int i;
+
+    for (i = 0; i < NEW_EVENTS; i++) {
+        if (s->news[i].usec && s->news[i].idx == idx) {
+            usec = s->news[i].usec;
+            s->news[i].usec = 0;
+            return usec;
+        }
+    }
+
+    return 0;
+}
+
+/* Update the state file copy of a loopback */
+static void loopback_save(struct loopback *l)
+{
+    struct state_entry *e = l->state;
+    struct output *o = &l->outputs[0];
+    const char *sink;
+
+    if (e == NULL)
+        return;
+
+    /* the first output stands in for the rest */
+    e->spec = l->spec;
+    e->stretched = l->outputs[0].stretched;
+    snprintf(e->description, sizeof(e->description), "%s", l->description);
+    snprintf(e->codec, sizeof(e->codec), "%s",
+            l->codec ? l->codec->name : "");
+
+    if (o->sink && pa_stream_get_state(o->sink) == PA_STREAM_READY) {
+        sink = pa_stream_get_device_name(o->sink);
+        snprintf(e->sink, sizeof(e->sink), "%s", sink ? sink : "");
+        e->attr = *pa_stream_get_buffer_attr(o->sink);
+    }
+}
+
+static int loopback_ready(struct loopback *l)
+{
+    unsigned int i;
+
+    if (pa_stream_get_state(l->source) != PA_STREAM_READY)
+        return 0;
+
+    for (i = 0; i < l->n_outputs; i++) {
+        if (pa_stream_get_state(l->outputs[i].sink) != PA_STREAM_READY)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void source_info(pa_context *c,
+        const pa_source_info *i, int eol, void *data);
+
+/* Give back a loopback's share of the budget, and give sources that
+ * were refused for lack of it another chance */
+static void loopback_unreserve(struct loopback *l)
+{
+    struct server *s;
+
+    if (!l->reserved)
+        return;
+
+    memory_used -= l->reserved;
+    l->reserved = 0;
+
+    list_for_each(&servers, s, list) {
+        if (s->refused && s->context &&
+                pa_context_get_state(s->context) == PA_CONTEXT_READY) {
+            s->refused = 0;
+            pao(pa_context_get_source_info_list(s->context,
+                        source_info, NULL));
+        }
+    }
+}
+
+static void loopback_free(struct loopback *l)
+{
+    unsigned int i;
+
+    if (l->milestones[MILESTONE_INFO] &&
+            !l->milestones[MILESTONE_FIRST_AUDIO])
+        ttfa.never_played++;
+
+    if (l->codec && l->outputs[0].first_audio_usec)
+        l->codec->played_usec +=
+            pa_rtclock_now() - l->outputs[0].first_audio_usec;
+
+    if (l->replacement)
+        loopback_free(l->replacement);
+
+    /* replacements aren't on the list until they are swapped in */
+    if (l->replacing)
+        l->replacing->replacement = NULL;
+    else
+        list_del(&l->list);
+
+    if (l->module_idx != PA_INVALID_INDEX)
+        pao(pa_context_unload_module(l->server->context,
+                    l->module_idx, NULL, NULL));
+    if (l->source) {
+        pa_stream_disconnect(l->source);
+        pa_stream_unref(l->source);
+    }
+    for (i = 0; i < l->n_outputs; i++) {
+        if (l->outputs[i].sink) {
+            pa_stream_disconnect(l->outputs[i].sink);
+            pa_stream_unref(l->outputs[i].sink);
+        }
+    }
+    if (l->align_timer)
+        mainloop_api->time_free(l->align_timer);
+    if (l->watchdog)
+        mainloop_api->time_free(l->watchdog);
+    tap_free(l->tap);
+    loopback_unreserve(l);
+    state_release(l->state);
+    resampler_free(l->resampler);
+    free(l->tail);
+    free(l->source_name);
+    free(l->description);
+    free(l);
+}
+
+/* For one turned away before it was connected or listed */
+static void loopback_discard(struct loopback *l)
+{
+    resampler_free(l->resampler);
+    free(l->tail);
+    free(l->source_name);
     free(l->description);
     free(l);
 }
 
-static void loopback_stop_all()
+static void loopback_stop(struct loopback* l)
+{
+    uint64_t dropped = 0;
+    unsigned int i;
+
+    PROBE3(loopback_stop, l->server->id, l->source_idx, l->description);
+    g_message("Removed A2DP Source: %s", l->description);
+    for (i = 0; i < l->n_outputs; i++)
+        dropped += l->outputs[i].dropped_bytes;
+    if (dropped)
+        g_message("Dropped %llu bytes from %s",
+                (unsigned long long)dropped, l->description);
+    loopback_free(l);
+}
+
+/* (Re)start recording a loopback if --tap asks for it, in the format
+ * the sinks are fed */
+static void loopback_tap(struct loopback *l)
+{
+    const char *match = config.tap_match;
+
+    tap_free(l->tap);
+    l->tap = NULL;
+
+    if (config.tap_dir && (match == NULL ||
+                strstr(l->source_name, match) ||
+                strstr(l->description, match)))
+        l->tap = tap_new(config.tap_dir, l->source_name, &l->sink_spec);
+}
+
+static void loopback_swap(struct loopback *n)
+{
+    struct loopback *old = n->replacing;
+
+    g_message("Reconfigured %s", n->description);
+    old->replacement = NULL;
+    n->replacing = NULL;
+    n->state = old->state;
+    old->state = NULL;
+    list_add(&n->server->loops, &n->list);
+    loopback_free(old);
+    loopback_save(n);
+    loopback_tap(n);
+}
+
+static void loopback_stop_all(struct server *s)
 {
     struct loopback *l, *n;
 
-    list_for_each_safe(&loops, l, n, list)
+    /* the state file keeps them for when we're back */
+    list_for_each_safe(&s->loops, l, n, list) {
+        l->state = NULL;
         loopback_stop(l);
+    }
 }
 
-static void loopback_read(pa_stream *s, size_t rlen, void *data)
+static void output_update_rate(struct output *o)
+{
+    uint32_t base = o->loop->sink_spec.rate, rate = base;
+
+    if (o->stretched)
+        rate += base * STRETCH_PERCENT / 100;
+    rate += (int)base * o->trim * ALIGN_PERMILLE / 1000;
+
+    pao(pa_stream_update_sample_rate(o->sink, rate, NULL, NULL));
+}
+
+static void output_stretch(struct output *o, int stretch)
+{
+    if (o->stretched == stretch)
+        return;
+
+    o->stretched = stretch;
+    output_update_rate(o);
+    loopback_save(o->loop);
+}
+
+static struct fragment* fragment_new(size_t len)
+{
+    struct fragment *f = malloc(sizeof(*f) + len);
+
+    f->refs = 1;
+    return f;
+}
+
+static void fragment_unref(void *data)
+{
+    struct fragment *f = (struct fragment*)data;
+
+    if (--f->refs == 0)
+        free(f);
+}
+
+/* Queue part of a fragment without copying it */
+static void output_queue(struct output *o, struct fragment *f,
+        const uint8_t *buffer, size_t len, pa_seek_mode_t seek)
+{
+    f->refs++;
+    if (pa_stream_write_ext_free(o->sink, buffer, len,
+                fragment_unref, f, 0, seek) < 0)
+        fragment_unref(f);
+}
+
+/* Write a fragment to the sink, applying the backpressure policy
+ * if the sink doesn't have room for all of it. Returns 1 if the end
+ * of it was dropped, so the sink queue doesn't end with it. */
+static int output_write(struct output *o, struct fragment *f,
+        const uint8_t *buffer, size_t len)
+{
+    size_t frame = pa_frame_size(&o->loop->sink_spec);
+    size_t writable, excess, tlength;
+
+    if (pa_stream_get_state(o->sink) != PA_STREAM_READY) {
+        o->early_bytes += len;
+        return 0;
+    }
+
+    writable = pa_stream_writable_size(o->sink);
+
+    if (config.backpressure == BACKPRESSURE_STRETCH) {
+        if (len > writable)
+            output_stretch(o, 1);
+        else if (writable >= pa_stream_get_buffer_attr(o->sink)->tlength / 2)
+            output_stretch(o, 0);
+    }
+
+    if (len <= writable ||
+            config.backpressure == BACKPRESSURE_NONE ||
+            config.backpressure == BACKPRESSURE_STRETCH) {
+        output_queue(o, f, buffer, len, PA_SEEK_RELATIVE);
+        return 0;
+    }
+
+    switch (config.backpressure) {
+        case BACKPRESSURE_DROP_OLD:
+            /* Write at the read index, so everything still queued is
+             * dropped and playback carries on from this fragment */
+            tlength = pa_stream_get_buffer_attr(o->sink)->tlength;
+            if (tlength > writable)
+                o->dropped_bytes += tlength - writable;
+            output_queue(o, f, buffer, len, PA_SEEK_RELATIVE_ON_READ);
+            return 0;
+
+        case BACKPRESSURE_DROP_NEW:
+            /* Round the overflow up to a whole frame */
+            excess = (len - writable + frame - 1) / frame * frame;
+            o->dropped_bytes += excess;
+            if (excess < len)
+                output_queue(o, f, buffer, len - excess, PA_SEEK_RELATIVE);
+            return 1;
+
+        default:
+            g_assert_not_reached();
+    }
+}
+
+/* Remember the end of what was just written for a later crossfade */
+static void loopback_save_tail(struct loopback *l,
+        const uint8_t *buffer, size_t len)
+{
+    size_t keep;
+
+    if (len >= l->tail_size) {
+        memcpy(l->tail, buffer + len - l->tail_size, l->tail_size);
+        l->tail_len = l->tail_size;
+        return;
+    }
+
+    keep = l->tail_size - len;
+    if (keep > l->tail_len)
+        keep = l->tail_len;
+
+    memmove(l->tail, l->tail + l->tail_len - keep, keep);
+    memcpy(l->tail + keep, buffer, len);
+    l->tail_len = keep + len;
+}
+
+/* Start skipping record data if the sink queue is over the threshold,
+ * the first sink is the reference as all of them skip together */
+static void loopback_catchup(struct loopback *l)
+{
+    pa_stream *sink = l->outputs[0].sink;
+    const pa_timing_info *t;
+    size_t frame = pa_frame_size(&l->spec);
+    size_t target, queued;
+
+    if (pa_stream_get_state(sink) != PA_STREAM_READY)
+        return;
+
+    t = pa_stream_get_timing_info(sink);
+    if (!t || t->write_index_corrupt || t->read_index_corrupt)
+        return;
+
+    if (t->write_index <= t->read_index)
+        return;
+
+    queued = t->write_index - t->read_index;
+    if (pa_bytes_to_usec(queued, &l->sink_spec) <=
+            config.catchup_msec * PA_USEC_PER_MSEC)
+        return;
+
+    target = pa_usec_to_bytes(config.catchup_target_msec * PA_USEC_PER_MSEC,
+            &l->sink_spec);
+    if (target < l->tail_size)
+        target = l->tail_size;
+    if (queued <= target)
+        return;
+
+    /* the skip happens on record data, before any resampling */
+    l->skip = pa_usec_to_bytes(pa_bytes_to_usec(queued - target,
+                &l->sink_spec), &l->spec) / frame * frame;
+    l->catchups++;
+}
+
+/* Blend the head of the new data into the saved tail and rewrite
+ * the end of the sink queues with the result. Returns bytes consumed. */
+static size_t loopback_crossfade(struct loopback *l,
+        const uint8_t *buffer, size_t len)
+{
+    size_t frame = pa_frame_size(&l->sink_spec);
+    size_t n = len < l->tail_len ? len : l->tail_len;
+    size_t frames, samples, i;
+    unsigned int j;
+    uint8_t *mix;
+
+    n -= n % frame;
+    frames = n / frame;
+    samples = n / pa_sample_size(&l->sink_spec);
+    mix = l->tail + l->tail_len - n;
+    if (!frames)
+        return 0;
+
+    if (l->sink_spec.format == PA_SAMPLE_S16NE) {
+        const int16_t *in = (const int16_t*)buffer;
+        int16_t *out = (int16_t*)mix;
+
+        for (i = 0; i < samples; i++) {
+            int32_t w = (i / l->sink_spec.channels + 1) * 32768 / (frames + 1);
+            out[i] = (out[i] * (32768 - w) + in[i] * w) >> 15;
+        }
+    }
+    else if (l->sink_spec.format == PA_SAMPLE_FLOAT32NE) {
+        const float *in = (const float*)buffer;
+        float *out = (float*)mix;
+
+        for (i = 0; i < samples; i++) {
+            float w = (float)(i / l->sink_spec.channels + 1) / (frames + 1);
+            out[i] = out[i] * (1 - w) + in[i] * w;
+        }
+    }
+    else
+        return 0;
+
+    for (j = 0; j < l->n_outputs; j++) {
+        if (pa_stream_get_state(l->outputs[j].sink) == PA_STREAM_READY)
+            pa_stream_write(l->outputs[j].sink, mix, n, NULL,
+                    -(int64_t)n, PA_SEEK_RELATIVE);
+    }
+    return n;
+}
+
+/* Keep the timings of a connect that got as far as playing */
+static void loopback_ttfa_done(struct loopback *l)
+{
+    pa_usec_t *sample = ttfa.samples[ttfa.n++ % TTFA_SAMPLES];
+    pa_usec_t base = l->milestones[MILESTONE_EVENT] ?
+        l->milestones[MILESTONE_EVENT] : l->milestones[MILESTONE_INFO];
+    char steps[256];
+    unsigned int i;
+    int len = 0;
+
+    ttfa.with_event += l->milestones[MILESTONE_EVENT] != 0;
+    for (i = 0; i < N_MILESTONES; i++) {
+        if (!l->milestones[i]) {
+            sample[i] = -1;
+            continue;
+        }
+        sample[i] = l->milestones[i] - base;
+        len += snprintf(steps + len, sizeof(steps) - len, "%s%s %llu",
+                len ? ", " : "", milestone_names[i],
+                (unsigned long long)(sample[i] / PA_USEC_PER_MSEC));
+    }
+
+    g_message("%s connected in ms: %s", l->description, steps);
+}
+
+/* Note when a new source's connect reached a step */
+static void loopback_milestone(struct loopback *l, enum milestone m)
+{
+    /* only new sources are timed */
+    if (!l->milestones[MILESTONE_INFO] || l->milestones[m])
+        return;
+
+    l->milestones[m] = pa_rtclock_now();
+    if (m == MILESTONE_FIRST_AUDIO)
+        loopback_ttfa_done(l);
+}
+
+/* A step once every sink stream is ready */
+static void loopback_sinks_ready(struct loopback *l)
+{
+    unsigned int i;
+
+    for (i = 0; i < l->n_outputs; i++) {
+        if (!l->outputs[i].sink || pa_stream_get_state(
+                    l->outputs[i].sink) != PA_STREAM_READY)
+            return;
+    }
+
+    loopback_milestone(l, MILESTONE_SINKS_READY);
+}
+
+/* Start the sink once the prebuffer target has been written */
+static void output_prebuffer(struct output *o, size_t len)
+{
+    if (pa_stream_get_state(o->sink) != PA_STREAM_READY)
+        return;
+
+    o->prebuffered += len;
+    if (o->prebuffered < o->loop->prebuf)
+        return;
+
+    o->corked = 0;
+    pao(pa_stream_cork(o->sink, 0, NULL, NULL));
+}
+
+static void output_started(pa_stream *s, void *data)
+{
+    struct output *o = (struct output*)data;
+
+    trace_started(o->loop->server->id, o->serial);
+    if (o->first_audio_usec)
+        return;
+
+    o->first_audio_usec = pa_rtclock_now();
+    o->ttfa_usec = o->first_audio_usec - o->loop->start_usec;
+    g_message("First audio from %s after %llu ms", o->loop->description,
+            (unsigned long long)(o->ttfa_usec / PA_USEC_PER_MSEC));
+    loopback_milestone(o->loop, MILESTONE_FIRST_AUDIO);
+}
+
+static void output_underflow(pa_stream *s, void *data)
+{
+    struct output *o = (struct output*)data;
+    struct codec *codec = o->loop->codec;
+    int startup;
+
+    trace_underflow(o->loop->server->id, o->serial);
+    startup = o->first_audio_usec && pa_rtclock_now() -
+        o->first_audio_usec < STARTUP_MSEC * PA_USEC_PER_MSEC;
+
+    o->underruns++;
+    o->startup_underruns += startup;
+    if (codec) {
+        codec->underruns++;
+        codec->startup_underruns += startup;
+    }
+}
+
+/* Keep the sinks of a fan-out in step: whichever are further behind
+ * than the average play a little faster until they catch up */
+static void loopback_align_check(pa_mainloop_api *api, pa_time_event *e,
+        const struct timeval *tv, void *data)
 {
     struct loopback *l = (struct loopback*)data;
-    const void *buffer;
+    pa_usec_t latency[MAX_SINKS], mean = 0;
+    unsigned int i;
+    int neg, trim;
 
-    g_assert(s == l->source);
-    pa_stream_peek(s, &buffer, &rlen);
-    g_assert(buffer && rlen);
-    pa_stream_write(l->sink, buffer, rlen, NULL, 0, 0);
-    pa_stream_drop(s);
+    pa_context_rttime_restart(l->server->context, e,
+            pa_rtclock_now() + ALIGN_MSEC * PA_USEC_PER_MSEC);
+
+    for (i = 0; i < l->n_outputs; i++) {
+        if (l->outputs[i].corked || pa_stream_get_latency(
+                    l->outputs[i].sink, &latency[i], &neg) < 0 || neg)
+            return;
+        mean += latency[i];
+    }
+    mean /= l->n_outputs;
+
+    for (i = 0; i < l->n_outputs; i++) {
+        if (latency[i] > mean + ALIGN_TOLERANCE_USEC)
+            trim = 1;
+        else if (latency[i] + ALIGN_TOLERANCE_USEC < mean)
+            trim = -1;
+        else
+            trim = 0;
+
+        if (l->outputs[i].trim != trim) {
+            l->outputs[i].trim = trim;
+            output_update_rate(&l->outputs[i]);
+        }
+    }
 }
 
-static void loopback_state(pa_stream *s, void *data)
+/* Before the first write, pad each sink with silence up to the slowest
+ * device so they all start together. Returns 0 until that is possible. */
+static int loopback_align(struct loopback *l)
 {
-    switch (pa_stream_get_state(s)) {
-        case PA_STREAM_CREATING:
-        case PA_STREAM_UNCONNECTED:
-        case PA_STREAM_TERMINATED:
-            break;
+    const pa_timing_info *t[MAX_SINKS];
+    pa_usec_t slowest = 0;
+    unsigned int i;
+    size_t pad;
 
-        case PA_STREAM_READY:
-            pao(pa_stream_flush(s, NULL, NULL));
-            break;
+    for (i = 0; i < l->n_outputs; i++) {
+        if (pa_stream_get_state(l->outputs[i].sink) != PA_STREAM_READY)
+            return 0;
+        t[i] = pa_stream_get_timing_info(l->outputs[i].sink);
+        if (t[i] == NULL)
+            return 0;
+        if (t[i]->sink_usec > slowest)
+            slowest = t[i]->sink_usec;
+    }
+
+    /* zero is silence for the S16 and float formats A2DP uses */
+    for (i = 0; i < l->n_outputs; i++) {
+        pad = pa_usec_to_bytes(slowest - t[i]->sink_usec, &l->sink_spec);
+        if (pad)
+            pa_stream_write(l->outputs[i].sink, calloc(1, pad), pad,
+                    free, 0, PA_SEEK_RELATIVE);
+    }
+
+    l->aligned = 1;
+    l->align_timer = pa_context_rttime_new(l->server->context,
+            pa_rtclock_now() + ALIGN_MSEC * PA_USEC_PER_MSEC,
+            loopback_align_check, l);
+    return 1;
+}
+
+/* Copy record data into a fragment, converting it to the sink rate
+ * on the way if resampling */
+static struct fragment* loopback_fragment(struct loopback *l,
+        const uint8_t *buffer, size_t *len)
+{
+    struct fragment *f;
+    size_t frames;
+
+    if (!l->resampler) {
+        f = fragment_new(*len);
+        memcpy(f->data, buffer, *len);
+        return f;
+    }
+
+    frames = *len / pa_frame_size(&l->spec);
+    f = fragment_new(resampler_out_max(l->resampler, frames) *
+            pa_frame_size(&l->sink_spec));
+    frames = resampler_process_s16(l->resampler,
+            (const int16_t*)buffer, frames, (int16_t*)f->data);
+    *len = frames * pa_frame_size(&l->sink_spec);
+    return f;
+}
+
+static void loopback_recovered(struct loopback *l)
+{
+    pa_usec_t took = l->last_read_usec - l->stall_usec;
+
+    g_message("%s is back after %s, %llu ms after the stall was noticed",
+            l->description, recovery_names[l->recovery],
+            (unsigned long long)(took / PA_USEC_PER_MSEC));
+
+    watchdog.recovered[l->recovery]++;
+    watchdog.recover_usec += took;
+    if (took > watchdog.recover_max)
+        watchdog.recover_max = took;
+    l->recovery = RECOVERY_NONE;
+}
+
+static void loopback_watchdog(pa_mainloop_api *api, pa_time_event *e,
+        const struct timeval *tv, void *data);
+
+/* Copy what the record stream has to the sinks, returns the bytes read */
+static size_t loopback_forward(struct loopback *l, pa_stream *s, size_t rlen)
+{
+    struct fragment *f;
+    const void *peek;
+    const uint8_t *buffer;
+    pa_usec_t now, due;
+    unsigned int i;
+    size_t n, len;
+    int cut = 0;
+
+    g_assert(s == l->source);
+    pa_stream_peek(s, &peek, &rlen);
+    g_assert(peek && rlen);
+    buffer = peek;
+    len = rlen;
+    trace_read(l->server->id, l->source_idx, rlen);
+
+    now = pa_rtclock_now();
+    if (l->last_read_len && !l->recovery) {
+        due = l->last_read_usec + pa_bytes_to_usec(l->last_read_len,
+                &l->spec);
+        due = now > due ? now - due : due - now;
+        l->jitter_usec += due;
+        if (due > l->jitter_max)
+            l->jitter_max = due;
+        l->jitter_reads++;
+    }
+    l->last_read_usec = now;
+    l->last_read_len = len;
+    loopback_milestone(l, MILESTONE_FIRST_READ);
+    if (l->recovery)
+        loopback_recovered(l);
+    if (config.watchdog_msec && !l->watchdog)
+        l->watchdog = pa_context_rttime_new(l->server->context,
+                l->last_read_usec + config.watchdog_msec * PA_USEC_PER_MSEC,
+                loopback_watchdog, l);
+
+    /* the old pair keeps playing until this one takes over, and
+     * fan-out sinks wait until they can be lined up */
+    if (l->replacing || (!l->aligned && !loopback_align(l))) {
+        pa_stream_drop(s);
+        return len;
+    }
+
+    if (config.catchup_msec && !l->skip)
+        loopback_catchup(l);
+
+    if (l->skip) {
+        n = rlen < l->skip ? rlen : l->skip;
+        l->skip -= n;
+        l->skipped_bytes += n;
+        l->fade = !l->skip;
+        buffer += n;
+        rlen -= n;
+    }
+
+    if (!rlen) {
+        pa_stream_drop(s);
+        return len;
+    }
+
+    /* one copy, shared by all of the sinks */
+    f = loopback_fragment(l, buffer, &rlen);
+    buffer = f->data;
+    pa_stream_drop(s);
+
+    if (rlen && l->fade) {
+        n = loopback_crossfade(l, buffer, rlen);
+        l->fade = 0;
+        buffer += n;
+        rlen -= n;
+    }
+
+    if (rlen) {
+        for (i = 0; i < l->n_outputs; i++) {
+            cut |= output_write(&l->outputs[i], f, buffer, rlen);
+            if (l->outputs[i].corked)
+                output_prebuffer(&l->outputs[i], rlen);
+        }
+        if (l->tap)
+            tap_write(l->tap, buffer, rlen);
+        /* a crossfade over what a sink never got would replace its
+         * queue with it */
+        if (cut)
+            l->tail_len = 0;
+        else if (config.catchup_msec)
+            loopback_save_tail(l, buffer, rlen);
+    }
+
+    fragment_unref(f);
+    return len;
+}
+
+static void loopback_read(pa_stream *s, size_t rlen, void *data)
+{
+    struct loopback *l = (struct loopback*)data;
+    struct perf_counts start;
+
+    if (!config.perf) {
+        rlen = loopback_forward(l, s, rlen);
+        PROBE3(loopback_read, l->server->id, l->source_idx, rlen);
+        return;
+    }
+
+    perf_read(&start);
+    rlen = loopback_forward(l, s, rlen);
+    perf_add(&l->perf, &start, rlen);
+    PROBE3(loopback_read, l->server->id, l->source_idx, rlen);
+}
+
+static void loopback_state(pa_stream *s, void *data)
+{
+    struct loopback *l = (struct loopback*)data;
+
+    /* output_state() has traced it already for a sink */
+    if (s == l->source)
+        trace_stream(l->server->id, l->source_serial,
+                pa_stream_get_state(s));
+
+    switch (pa_stream_get_state(s)) {
+        case PA_STREAM_CREATING:
+        case PA_STREAM_UNCONNECTED:
+        case PA_STREAM_TERMINATED:
+            break;
+
+        case PA_STREAM_READY:
+            /* drop whatever the source captured before we got here,
+             * the sinks are corked and fill from that point on */
+            if (s == l->source)
+                pao(pa_stream_flush(s, NULL, NULL));
+            if (s == l->source && l->source_idx == PA_INVALID_INDEX)
+                l->source_idx = pa_stream_get_device_index(s);
+            if (s == l->source)
+                loopback_milestone(l, MILESTONE_RECORD_READY);
+            else
+                loopback_sinks_ready(l);
+            if (s == l->outputs[0].sink)
+                loopback_save(l);
+            if (l->replacing && loopback_ready(l))
+                loopback_swap(l);
+            break;
+
+        case PA_STREAM_FAILED:
+            g_warning("Stream failure: %s", pa_strerror(
+                        pa_context_errno(server_streams(l->server))));
+            /* a failed replacement leaves the old pair running */
+            if (l->replacing)
+                loopback_free(l);
+            else
+                loopback_stop(l);
+            break;
+    }
+}
+
+static void output_callbacks(struct output *o);
+
+/* Stop playing on one sink, the others carry on */
+static void loopback_drop_output(struct loopback *l, struct output *o)
+{
+    struct output *i;
+
+    g_warning("Dropping %s from %s", o->device ? o->device : "default sink",
+            l->description);
+    pa_stream_set_state_callback(o->sink, NULL, NULL);
+    pa_stream_set_started_callback(o->sink, NULL, NULL);
+    pa_stream_set_underflow_callback(o->sink, NULL, NULL);
+    pa_stream_disconnect(o->sink);
+    pa_stream_unref(o->sink);
+
+    l->n_outputs--;
+    memmove(o, o + 1, (l->outputs + l->n_outputs - o) * sizeof(*o));
+    /* the ones that moved down need their callbacks pointed at them */
+    for (i = o; i < l->outputs + l->n_outputs; i++)
+        output_callbacks(i);
+
+    if (o == l->outputs)
+        loopback_save(l);
+    loopback_sinks_ready(l);
+}
+
+static void output_state(pa_stream *s, void *data)
+{
+    struct output *o = (struct output*)data;
+    struct loopback *l = o->loop;
+
+    trace_stream(l->server->id, o->serial, pa_stream_get_state(s));
+    /* a failed replacement is dropped whole by loopback_state() */
+    if (pa_stream_get_state(s) == PA_STREAM_FAILED && l->n_outputs > 1 &&
+            !l->replacing) {
+        g_warning("Stream failure: %s", pa_strerror(
+                    pa_context_errno(server_streams(l->server))));
+        loopback_drop_output(l, o);
+        return;
+    }
+
+    loopback_state(s, l);
+}
+
+static uint32_t latency_tlength(const struct latency_profile *latency,
+        const pa_sample_spec *spec)
+{
+    return pa_usec_to_bytes(latency->tlength_msec * PA_USEC_PER_MSEC, spec);
+}
+
+/* The codec's buffering when it is known, the profile's otherwise */
+static struct latency_profile loopback_latency(struct loopback *l)
+{
+    return l->codec && config.codec_latency ?
+        l->codec->latency : *config.profile;
+}
+
+static pa_cvolume* config_volume(pa_cvolume *v, uint8_t channels)
+{
+    return pa_cvolume_set(v, channels,
+            (uint64_t)PA_VOLUME_NORM * config.volume_percent / 100);
+}
+
+/* Number the stream for the trace, which can't go by the pointer */
+static pa_stream* stream_new(pa_context *c, const char *name,
+        const pa_sample_spec *spec, uint32_t *serial)
+{
+    *serial = stream_serial++;
+    return pa_stream_new(c, name, spec, NULL);
+}
+
+/* Without attr, buffer as the latency profile says. maxlength is -1
+ * for the server default. */
+static pa_stream* sink_stream_new(pa_context *c, const char *name,
+        const pa_sample_spec *spec, const char *dev,
+        const pa_buffer_attr *attr, const struct latency_profile *latency,
+        uint32_t maxlength, pa_stream_flags_t flags, uint32_t *serial)
+{
+    pa_buffer_attr profile = {-1, -1, -1, -1, -1};
+    pa_cvolume volume;
+    pa_stream *s;
+
+    if (attr == NULL)
+        profile.tlength = latency_tlength(latency, spec);
+    else
+        profile = *attr;
+    /* output_prebuffer() does the prebuffering before uncorking, the
+     * server doing it again would only add to the startup delay */
+    profile.prebuf = 0;
+
+    if (maxlength != (uint32_t)-1) {
+        profile.maxlength = maxlength;
+        if (profile.tlength > maxlength)
+            profile.tlength = maxlength;
+    }
+    attr = &profile;
+
+    /* variable rate for stretching and following source rate changes,
+     * corked until output_prebuffer() has filled it */
+    flags |= PA_STREAM_ADJUST_LATENCY | PA_STREAM_VARIABLE_RATE |
+        PA_STREAM_START_CORKED;
+    if (config.catchup_msec || config.n_sinks > 1)
+        flags |= PA_STREAM_AUTO_TIMING_UPDATE;
+
+    s = stream_new(c, name, spec, serial);
+    pa_stream_connect_playback(s, dev, attr, flags,
+            config.volume_percent != 100 ?
+            config_volume(&volume, spec->channels) : NULL, NULL);
+    return s;
+}
+
+/* The BlueZ address in the form used by object paths: AA_BB_CC_DD_EE_FF */
+static int source_device(const pa_source_info *i, char device[18])
+{
+    const char *addr, *end;
+    size_t n;
+
+    addr = pa_proplist_gets(i->proplist, PA_PROP_DEVICE_STRING);
+    if (addr == NULL || strlen(addr) != 17) {
+        /* Fall back on bluez_source.AA_BB_CC_DD_EE_FF.a2dp_source */
+        addr = strchr(i->name, '.');
+        if (addr == NULL)
+            return 0;
+        addr++;
+        end = strchr(addr, '.');
+        n = end ? (size_t)(end - addr) : strlen(addr);
+        if (n != 17)
+            return 0;
+    }
+
+    for (n = 0; n < 17; n++)
+        device[n] = addr[n] == ':' ? '_' : addr[n];
+    device[17] = '\0';
+    return 1;
+}
+
+static void prearm_free(struct prearm *p)
+{
+    list_del(&p->list);
+    pa_stream_set_state_callback(p->sink, NULL, NULL);
+    pa_stream_disconnect(p->sink);
+    pa_stream_unref(p->sink);
+    free(p);
+}
+
+static void prearm_free_all(struct server *s)
+{
+    struct prearm *p, *n;
+
+    list_for_each_safe(&s->prearms, p, n, list)
+        prearm_free(p);
+}
+
+static struct prearm* prearm_get(struct server *s, const char *device)
+{
+    struct prearm *p;
+
+    list_for_each(&s->prearms, p, list) {
+        if (!strcmp(p->device, device))
+            return p;
+    }
+
+    return NULL;
+}
+
+static void prearm_state(pa_stream *s, void *data)
+{
+    struct prearm *p = (struct prearm*)data;
+
+    trace_stream(p->server->id, p->serial, pa_stream_get_state(s));
+    if (pa_stream_get_state(s) == PA_STREAM_FAILED) {
+        g_warning("Pre-armed stream failure: %s",
+                pa_strerror(pa_context_errno(server_streams(p->server))));
+        prearm_free(p);
+    }
+}
+
+static int latency_equal(const struct latency_profile *a,
+        const struct latency_profile *b)
+{
+    return a->prebuf_msec == b->prebuf_msec &&
+        a->tlength_msec == b->tlength_msec;
+}
+
+/* Hand over the pre-armed sink for this source if it is usable */
+static pa_stream* prearm_take(struct server *server,
+        const pa_source_info *i, const pa_sample_spec *spec,
+        const struct latency_profile *latency, uint32_t *serial)
+{
+    struct prearm *p;
+    char device[18];
+    pa_stream *s;
+
+    if (!source_device(i, device) || !(p = prearm_get(server, device)))
+        return NULL;
+
+    s = pa_stream_ref(p->sink);
+    if (pa_stream_get_state(s) != PA_STREAM_READY ||
+            !pa_sample_spec_equal(pa_stream_get_sample_spec(s), spec) ||
+            !latency_equal(&p->latency, latency)) {
+        pa_stream_unref(s);
+        s = NULL;
+    }
+
+    *serial = p->serial;
+    prearm_free(p);
+    return s;
+}
+
+static void output_callbacks(struct output *o)
+{
+    pa_stream_set_state_callback(o->sink, output_state, o);
+    pa_stream_set_started_callback(o->sink, output_started, o);
+    pa_stream_set_underflow_callback(o->sink, output_underflow, o);
+}
+
+/* The budget's maxlength is in sink bytes, this is the same length
+ * of audio in the source's format */
+static uint32_t record_bytes(struct loopback *l, uint32_t sink_bytes)
+{
+    return pa_usec_to_bytes(pa_bytes_to_usec(sink_bytes, &l->sink_spec),
+            &l->spec);
+}
+
+static void loopback_connect_source(struct loopback *l)
+{
+    pa_buffer_attr attr = {-1, -1, -1, -1, -1};
+    pa_stream_flags_t flags = PA_STREAM_DONT_MOVE | PA_STREAM_VARIABLE_RATE;
+
+    /* the timing info tells how much the server is holding */
+    if (config.memory_kb) {
+        attr.maxlength = record_bytes(l, l->maxlength);
+        flags |= PA_STREAM_AUTO_TIMING_UPDATE;
+    }
+    if (l->latency.fragsize_msec)
+        attr.fragsize = pa_usec_to_bytes(
+                l->latency.fragsize_msec * PA_USEC_PER_MSEC, &l->spec);
+
+    l->source = stream_new(server_streams(l->server), l->description,
+            &l->spec, &l->source_serial);
+    pa_stream_set_state_callback(l->source, loopback_state, l);
+    pa_stream_set_read_callback(l->source, loopback_read, l);
+    pa_stream_connect_record(l->source, l->source_name, &attr, flags);
+}
+
+/* Take the next recovery step for a loopback whose source is running
+ * but hasn't delivered anything for the watchdog timeout */
+static void loopback_recover(pa_context *c, struct loopback *l)
+{
+    pa_usec_t now = pa_rtclock_now(), *since;
+    uint32_t idx = l->source_idx;
+
+    if (l->recovery == RECOVERY_NONE) {
+        l->stall_usec = now;
+        watchdog.stalls++;
+        watchdog.detect_usec += now - l->last_read_usec;
+        if (now - l->last_read_usec > watchdog.detect_max)
+            watchdog.detect_max = now - l->last_read_usec;
+        g_warning("No data from %s for %llu ms", l->description,
+                (unsigned long long)((now - l->last_read_usec) /
+                    PA_USEC_PER_MSEC));
+    }
+
+    l->recovery++;
+    l->step_usec = now;
+
+    switch (l->recovery) {
+        case RECOVERY_FLUSH:
+            g_message("Flushing %s", l->description);
+            pao(pa_stream_flush(l->source, NULL, NULL));
+            break;
+
+        case RECOVERY_RECONNECT:
+            g_message("Reconnecting the record stream of %s",
+                    l->description);
+            pa_stream_set_state_callback(l->source, NULL, NULL);
+            pa_stream_set_read_callback(l->source, NULL, NULL);
+            pa_stream_disconnect(l->source);
+            pa_stream_unref(l->source);
+            loopback_connect_source(l);
+            break;
+
+        case RECOVERY_REBUILD:
+            /* source_info hands the stall on to the new loopback */
+            g_message("Rebuilding %s", l->description);
+            since = malloc(sizeof(*since));
+            *since = l->stall_usec;
+            loopback_free(l);
+            pao(pa_context_get_source_info_by_index(c, idx,
+                        source_info, since));
+            break;
+
+        default:
+            g_warning("Giving up on %s until it delivers again",
+                    l->description);
+            break;
+    }
+}
+
+static void loopback_stalled(pa_context *c,
+        const pa_source_info *i, int eol, void *data)
+{
+    struct loopback *l;
+
+    trace_source(server_get(c)->id, i, eol);
+    if (eol)
+        return;
+
+    l = loopback_get(server_get(c), i->index);
+    if (l == NULL)
+        return;
+
+    /* a suspended source is expected to be silent, stand the watchdog
+     * down until source_changed() sees it running again */
+    if (i->state != PA_SOURCE_RUNNING) {
+        if (l->watchdog) {
+            mainloop_api->time_free(l->watchdog);
+            l->watchdog = NULL;
+        }
+        return;
+    }
+
+    if (pa_rtclock_now() - l->last_read_usec <
+            config.watchdog_msec * PA_USEC_PER_MSEC)
+        return;
+
+    loopback_recover(c, l);
+}
+
+/* Gives each recovery step a full timeout to take effect */
+static void loopback_watchdog(pa_mainloop_api *api, pa_time_event *e,
+        const struct timeval *tv, void *data)
+{
+    struct loopback *l = (struct loopback*)data;
+    pa_usec_t now = pa_rtclock_now();
+    pa_usec_t timeout = config.watchdog_msec * PA_USEC_PER_MSEC;
+
+    /* turned off by a reload, the next read arms it again if need be */
+    if (!timeout) {
+        api->time_free(e);
+        l->watchdog = NULL;
+        return;
+    }
+
+    pa_context_rttime_restart(l->server->context, e, now + timeout / 2);
+
+    if (l->replacing || l->source_idx == PA_INVALID_INDEX ||
+            l->recovery == RECOVERY_GIVEN_UP ||
+            now - l->last_read_usec < timeout ||
+            (l->recovery && now - l->step_usec < timeout))
+        return;
+
+    pao(pa_context_get_source_info_by_index(l->server->context,
+                l->source_idx, loopback_stalled, NULL));
+}
+
+static void loopback_connect(pa_context *c, struct loopback *l,
+        const pa_source_info *i)
+{
+    struct output *o;
+
+    loopback_connect_source(l);
+
+    /* sink streams, the default one is already connected
+     * if the device was pre-armed */
+    for (o = l->outputs; o < l->outputs + l->n_outputs; o++) {
+        if (o->device == NULL)
+            o->sink = prearm_take(l->server, i, &l->sink_spec,
+                    &l->latency, &o->serial);
+        if (o->sink) {
+            g_message("Using pre-armed sink for %s", l->description);
+        }
+        else {
+            o->sink = sink_stream_new(server_streams(l->server),
+                    l->description, &l->sink_spec, o->device, NULL,
+                    &l->latency, l->maxlength, 0, &o->serial);
+        }
+        output_callbacks(o);
+    }
+    /* pre-armed sinks are ready already */
+    loopback_sinks_ready(l);
+
+    if (!l->replacing) {
+        l->state = state_slot(l->server->address, l->source_name);
+        loopback_save(l);
+        loopback_tap(l);
+    }
+}
+
+static void module_loaded(pa_context *c, uint32_t idx, void *data)
+{
+    uint32_t source_idx = (uintptr_t)data;
+    struct loopback *l = loopback_get(server_get(c), source_idx);
+
+    if (idx == PA_INVALID_INDEX) {
+        g_warning("Failed to load module-loopback: %s",
+                pa_strerror(pa_context_errno(c)));
+        if (l != NULL)
+            loopback_stop(l);
+        return;
+    }
+
+    /* The source went away while the module was loading */
+    if (l == NULL) {
+        pao(pa_context_unload_module(c, idx, NULL, NULL));
+        return;
+    }
+
+    l->module_idx = idx;
+}
+
+/* Let the server do the work with module-loopback */
+static void loopback_load_module(pa_context *c, struct loopback *l,
+        const char *source)
+{
+    char *args;
+
+    args = loopback_module_args(source,
+            config.module_latency_msec, config.catchup_msec);
+    g_assert(args);
+
+    pao(pa_context_load_module(c, "module-loopback", args,
+                module_loaded, (void*)(uintptr_t)l->source_idx));
+    free(args);
+}
+
+/* Pick the sink format, converting in process to the default sink's
+ * rate when asked to, and size the buffers that depend on it */
+static void loopback_resampler(struct loopback *l)
+{
+    uint32_t sink_rate = l->server->sink_rate;
+
+    resampler_free(l->resampler);
+    l->resampler = NULL;
+
+    if (config.resample != RESAMPLE_OFF && sink_rate &&
+            l->spec.format == PA_SAMPLE_S16NE && l->spec.rate != sink_rate)
+        l->resampler = resampler_new(l->spec.channels, l->spec.rate,
+                sink_rate, config.resample);
+
+    l->sink_spec = l->spec;
+    if (l->resampler) {
+        l->sink_spec.rate = sink_rate;
+        g_message("Resampling %s from %u to %u Hz (%s)", l->description,
+                l->spec.rate, sink_rate, resampler_kernel(l->resampler));
+    }
+
+    l->prebuf = pa_usec_to_bytes(
+            l->latency.prebuf_msec * PA_USEC_PER_MSEC, &l->sink_spec);
+    l->tail_size = pa_usec_to_bytes(CROSSFADE_MSEC * PA_USEC_PER_MSEC,
+            &l->sink_spec);
+    l->tail = realloc(l->tail, l->tail_size);
+    l->tail_len = 0;
+}
+
+/* Roughly what a loopback holds with a given maxlength: a server and a
+ * client copy of the record buffer, each sink's buffer on the server,
+ * and our own crossfade tail and resampler */
+static size_t loopback_cost(struct loopback *l, uint32_t maxlength)
+{
+    size_t cost = (size_t)maxlength * l->n_outputs +
+        (size_t)record_bytes(l, maxlength) * 2 + l->tail_size;
+
+    if (l->resampler)
+        cost += resampler_memory(l->resampler);
+
+    return cost;
+}
+
+/* Count a source turned away for lack of memory, or take that back */
+static void server_refused(struct server *s, int n)
+{
+    s->refused += n;
+    refused_total += n;
+}
+
+/* Take this loopback's share of the memory budget, shrinking its
+ * buffers down to the profile's target length if that's all that is
+ * left. Returns 1 if even that doesn't fit. */
+static int loopback_reserve(struct loopback *l)
+{
+    size_t budget = (size_t)config.memory_kb * 1024, fixed, left;
+    uint64_t per_sec;
+    uint32_t full, min;
+
+    l->maxlength = -1;
+    if (!config.memory_kb)
+        return 0;
+
+    min = latency_tlength(&l->latency, &l->sink_spec);
+    full = min * MAXLENGTH_FACTOR;
+    fixed = loopback_cost(l, 0);
+    left = budget > memory_used ? budget - memory_used : 0;
+
+    if (loopback_cost(l, full) <= left)
+        l->maxlength = full;
+    else if (loopback_cost(l, min) <= left) {
+        /* all that is left, shared out by the bytes per second of
+         * the sinks and the record copies */
+        per_sec = (uint64_t)pa_bytes_per_second(&l->sink_spec) *
+            l->n_outputs + (uint64_t)pa_bytes_per_second(&l->spec) * 2;
+        l->maxlength = pa_usec_to_bytes((uint64_t)(left - fixed) *
+                PA_USEC_PER_SEC / per_sec, &l->sink_spec);
+        degraded_total++;
+        g_message("Memory budget low, %s gets %u ms of buffer",
+                l->description, (unsigned int)(pa_bytes_to_usec(
+                        l->maxlength, &l->sink_spec) / PA_USEC_PER_MSEC));
+    }
+    else {
+        server_refused(l->server, 1);
+        g_warning("Memory budget exhausted, not starting %s",
+                l->description);
+        return 1;
+    }
+
+    l->reserved = loopback_cost(l, l->maxlength);
+    memory_used += l->reserved;
+    return 0;
+}
+
+static struct loopback* loopback_new(struct server *s, uint32_t source_idx,
+        const char *name, const char *description,
+        const pa_sample_spec *spec, struct codec *codec)
+{
+    struct loopback *l;
+    unsigned int i;
+
+    l = calloc(1, sizeof(*l));
+    l->server = s;
+    l->source_idx = source_idx;
+    l->module_idx = PA_INVALID_INDEX;
+    l->spec = *spec;
+    l->source_name = strdup(name);
+    l->description = strdup(description);
+    l->codec = codec;
+    l->latency = loopback_latency(l);
+    loopback_resampler(l);
+    l->start_usec = pa_rtclock_now();
+
+    l->n_outputs = config.n_sinks ? config.n_sinks : 1;
+    l->aligned = l->n_outputs == 1;
+    for (i = 0; i < l->n_outputs; i++) {
+        l->outputs[i].loop = l;
+        l->outputs[i].device = config.sinks[i];
+        l->outputs[i].corked = 1;
+    }
+
+    return l;
+}
+
+/* A rebuild takes over from a loopback that was already counted */
+static void loopback_start(pa_context *c, const pa_source_info *i,
+        int rebuild)
+{
+    struct server *s = server_get(c);
+    struct loopback *l;
+
+    g_assert(!loopback_get(s, i->index));
+    PROBE3(loopback_start, s->id, i->index, i->description);
+    g_message("New A2DP Source: %s", i->description);
+
+    /* make sure the source is not muted */
+    pao(pa_context_set_source_mute_by_index(c, i->index, 0, NULL, NULL));
+
+    l = loopback_new(s, i->index, i->name, i->description,
+            &i->sample_spec, codec_find(i->proplist));
+    if (config.engine == ENGINE_STREAM && !rebuild) {
+        l->milestones[MILESTONE_EVENT] = source_new_usec(s, i->index);
+        l->milestones[MILESTONE_INFO] = l->start_usec;
+    }
+    if (l->codec) {
+        g_message("%s uses %s, buffering %u/%u ms", i->description,
+                l->codec->name, l->latency.prebuf_msec,
+                l->latency.tlength_msec);
+        if (!rebuild)
+            l->codec->loopbacks++;
+    }
+    if (config.engine == ENGINE_MODULE)
+        loopback_load_module(c, l, i->name);
+    else if (loopback_reserve(l)) {
+        loopback_discard(l);
+        return;
+    }
+    else
+        loopback_connect(c, l, i);
+
+    list_add(&s->loops, &l->list);
+}
+
+/* Bring back every loopback in the state file in one batch, the source
+ * list that follows checks them against what the server really has */
+static void loopback_restore_all(pa_context *c)
+{
+    struct server *s = server_get(c);
+    struct state_entry *e;
+    struct loopback *l;
+    struct output *o;
+    pa_sample_spec spec;
+    int i = 0;
+
+    while ((e = state_next(s->address, &i)) != NULL) {
+        if (loopback_find(s, e->source))
+            continue;
+
+        if (!pa_sample_spec_valid(&e->spec)) {
+            state_release(e);
+            continue;
+        }
+
+        g_message("Restoring A2DP Source: %s", e->description);
+        l = loopback_new(s, PA_INVALID_INDEX, e->source,
+                e->description, &e->spec, codec_get(e->codec));
+        if (l->codec)
+            l->codec->loopbacks++;
+        if (loopback_reserve(l)) {
+            loopback_discard(l);
+            state_release(e);
+            continue;
+        }
+        l->state = e;
+        l->restored = 1;
+        l->outputs[0].stretched = e->stretched;
+        loopback_connect_source(l);
+
+        /* the saved sink and buffer are those of the first output */
+        for (o = l->outputs; o < l->outputs + l->n_outputs; o++) {
+            spec = l->sink_spec;
+            if (o->stretched)
+                spec.rate += spec.rate * STRETCH_PERCENT / 100;
+            if (o == l->outputs)
+                o->sink = sink_stream_new(server_streams(s),
+                        l->description, &spec,
+                        o->device ? o->device : e->sink[0] ? e->sink : NULL,
+                        e->attr.maxlength ? &e->attr : NULL,
+                        &l->latency, l->maxlength, 0, &o->serial);
+            else
+                o->sink = sink_stream_new(server_streams(s),
+                        l->description, &spec, o->device, NULL,
+                        &l->latency, l->maxlength, 0, &o->serial);
+            output_callbacks(o);
+        }
+
+        loopback_tap(l);
+        list_add(&s->loops, &l->list);
+    }
+}
+
+/* data is set when rebuilding a stalled loopback */
+static void source_info(pa_context *c,
+        const pa_source_info *i, int eol, void *data)
+{
+    pa_usec_t *stalled = (pa_usec_t*)data;
+    struct loopback *l;
+
+    trace_source(server_get(c)->id, i, eol);
+    if (eol) {
+        free(stalled);
+        return;
+    }
+
+    if (!source_match(i->proplist))
+        return;
+
+    if (loopback_get(server_get(c), i->index) != NULL)
+        return;
+
+    loopback_start(c, i, stalled != NULL);
+
+    /* watch it from the start, it may never deliver either */
+    l = loopback_get(server_get(c), i->index);
+    if (stalled && l != NULL && config.engine == ENGINE_STREAM) {
+        l->stall_usec = *stalled;
+        l->step_usec = l->last_read_usec = pa_rtclock_now();
+        l->recovery = RECOVERY_REBUILD;
+        l->watchdog = pa_context_rttime_new(c, l->step_usec +
+                config.watchdog_msec * PA_USEC_PER_MSEC,
+                loopback_watchdog, l);
+    }
+}
+
+/* Redo only what a source change requires: a new rate is applied to the
+ * running streams, anything else gets a new pair swapped in once ready */
+static void source_changed(pa_context *c,
+        const pa_source_info *i, int eol, void *data)
+{
+    struct loopback *l, *n;
+    unsigned int j;
+
+    trace_source(server_get(c)->id, i, eol);
+    if (eol)
+        return;
+
+    l = loopback_get(server_get(c), i->index);
+    if (l == NULL || config.engine != ENGINE_STREAM)
+        return;
+
+    if (!source_match(i->proplist)) {
+        loopback_stop(l);
+        return;
+    }
+
+    /* running again after the watchdog was stood down */
+    if (i->state == PA_SOURCE_RUNNING && config.watchdog_msec &&
+            !l->watchdog && l->last_read_usec)
+        l->watchdog = pa_context_rttime_new(l->server->context,
+                pa_rtclock_now() + config.watchdog_msec * PA_USEC_PER_MSEC,
+                loopback_watchdog, l);
+
+    if (l->replacement) {
+        if (pa_sample_spec_equal(&l->replacement->spec, &i->sample_spec))
+            return;
+        loopback_free(l->replacement);
+    }
+
+    if (pa_sample_spec_equal(&l->spec, &i->sample_spec))
+        return;
+
+    if (l->spec.format == i->sample_spec.format &&
+            l->spec.channels == i->sample_spec.channels &&
+            loopback_ready(l)) {
+        g_message("Rate change on %s: %u -> %u Hz", l->description,
+                l->spec.rate, i->sample_spec.rate);
+        l->spec.rate = i->sample_spec.rate;
+        loopback_resampler(l);
+        pao(pa_stream_update_sample_rate(l->source, l->spec.rate,
+                    NULL, NULL));
+        for (j = 0; j < l->n_outputs; j++)
+            output_update_rate(&l->outputs[j]);
+        loopback_save(l);
+        if (l->tap)
+            loopback_tap(l);
+        return;
+    }
+
+    g_message("Format change on %s, rebuilding streams", l->description);
+    n = loopback_new(l->server, i->index, i->name, i->description,
+            &i->sample_spec, codec_find(i->proplist));
+    if (loopback_reserve(n)) {
+        /* the old pair will have to do, no need to retry */
+        server_refused(l->server, -1);
+        loopback_discard(n);
+        return;
+    }
+    n->replacing = l;
+    l->replacement = n;
+    loopback_connect(c, n, i);
+}
+
+static void default_sink_info(pa_context *c,
+        const pa_sink_info *i, int eol, void *data)
+{
+    struct server *s = server_get(c);
+
+    trace_sink(s->id, i, eol);
+    if (eol || i->sample_spec.rate == s->sink_rate)
+        return;
+
+    s->sink_rate = i->sample_spec.rate;
+    g_message("Default sink on %s runs at %u Hz", server_name(s),
+            s->sink_rate);
+}
+
+/* Entries of a batched lookup, only those that had a NEW event count */
+static void source_burst(pa_context *c,
+        const pa_source_info *i, int eol, void *data)
+{
+    struct burst *b = (struct burst*)data;
+    unsigned int j;
+
+    if (eol) {
+        trace_source(server_get(c)->id, i, eol);
+        free(b);
+        return;
+    }
 
-        case PA_STREAM_FAILED:
-            g_warning("Stream failure: %s",
-                    pa_strerror(pa_context_errno(context)));
-            loopback_stop((struct loopback*)data);
-            break;
+    for (j = 0; j < b->n; j++) {
+        if (b->idx[j] == i->index) {
+            source_info(c, i, eol, NULL);
+            return;
+        }
     }
 }
 
-static void loopback_start(pa_context *c, const pa_source_info *i)
+static void burst_lookup(struct server *s)
 {
-    struct loopback *l;
-    pa_buffer_attr max_latency = {-1, -1, -1, -1, -1};
-
-    g_assert(!loopback_get(i->index));
-    g_message("New A2DP Source: %s", i->description);
+    struct burst *b;
 
-    /* make sure the source is not muted */
-    pao(pa_context_set_source_mute_by_index(c, i->index, 0, NULL, NULL));
-
-    l = malloc(sizeof(*l));
-    l->source_idx = i->index;
-    l->description = strdup(i->description);
+    bursts.lookups++;
+    if (s->n_burst == 1) {
+        pao(pa_context_get_source_info_by_index(s->context, s->burst[0],
+                    source_info, NULL));
+    }
+    else {
+        b = malloc(sizeof(*b) + sizeof(b->idx[0]) * s->n_burst);
+        b->n = s->n_burst;
+        memcpy(b->idx, s->burst, sizeof(b->idx[0]) * s->n_burst);
+        pao(pa_context_get_source_info_list(s->context, source_burst, b));
+    }
+    s->n_burst = 0;
+}
 
-    /* source stream */
-    l->source = pa_stream_new(c, l->description, &i->sample_spec, NULL);
-    pa_stream_set_state_callback(l->source, loopback_state, l);
-    pa_stream_set_read_callback(l->source, loopback_read, l);
-    pa_stream_connect_record(l->source, i->name, NULL, PA_STREAM_DONT_MOVE);
+/* The window stays open as long as events keep coming */
+static void burst_timeout(pa_mainloop_api *api, pa_time_event *e,
+        const struct timeval *tv, void *data)
+{
+    struct server *s = (struct server*)data;
 
-    /* sink stream */
-    l->sink = pa_stream_new(c, l->description, &i->sample_spec, NULL);
-    pa_stream_set_state_callback(l->sink, loopback_state, l);
-    pa_stream_connect_playback(l->sink, NULL, &max_latency,
-            PA_STREAM_ADJUST_LATENCY, NULL, NULL);
+    if (!s->n_burst) {
+        api->time_free(e);
+        s->burst_timer = NULL;
+        return;
+    }
 
-    list_add(&loops, &l->list);
+    burst_lookup(s);
+    pa_context_rttime_restart(s->context, e,
+            pa_rtclock_now() + BURST_MSEC * PA_USEC_PER_MSEC);
 }
 
-static void source_info(pa_context *c,
-        const pa_source_info *i, int eol, void *data)
+/* A lone event is looked up right away and opens a window, events
+ * during it wait for its end to be looked up together */
+static void source_new(struct server *s, uint32_t idx)
 {
-    const char *proto;
+    bursts.events++;
+    s->news[s->next_new].idx = idx;
+    s->news[s->next_new].usec = pa_rtclock_now();
+    s->next_new = (s->next_new + 1) % NEW_EVENTS;
 
-    if (eol)
+    if (s->burst_timer == NULL) {
+        bursts.lookups++;
+        pao(pa_context_get_source_info_by_index(s->context, idx,
+                    source_info, NULL));
+        s->burst_timer = pa_context_rttime_new(s->context,
+                pa_rtclock_now() + BURST_MSEC * PA_USEC_PER_MSEC,
+                burst_timeout, s);
         return;
+    }
 
-    proto = pa_proplist_gets(i->proplist, "bluetooth.protocol");
-    if (proto == NULL)
-        return;
+    if (s->n_burst == s->burst_size) {
+        s->burst_size = s->burst_size ? s->burst_size * 2 : 16;
+        s->burst = realloc(s->burst, sizeof(*s->burst) * s->burst_size);
+    }
+    s->burst[s->n_burst++] = idx;
+}
 
-    if (strcmp("a2dp_source", proto))
-        return;
+/* Returns 1 if the source was still waiting to be looked up */
+static int source_removed(struct server *s, uint32_t idx)
+{
+    unsigned int i;
 
-    if (loopback_get(i->index) != NULL)
-        return;
+    for (i = 0; i < s->n_burst; i++) {
+        if (s->burst[i] == idx) {
+            s->burst[i] = s->burst[--s->n_burst];
+            bursts.cancelled++;
+            return 1;
+        }
+    }
+
+    return 0;
+}
 
-    loopback_start(c, i);
+static void burst_reset(struct server *s)
+{
+    if (s->burst_timer) {
+        mainloop_api->time_free(s->burst_timer);
+        s->burst_timer = NULL;
+    }
+    s->n_burst = 0;
 }
 
 static void context_event(pa_context *c,
@@ -141,34 +1930,105 @@ static void context_event(pa_context *c,
 {
     int facility = t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
     int type = t & PA_SUBSCRIPTION_EVENT_TYPE_MASK;
+    struct server *s = server_get(c);
 
+    trace_event(s->id, t, idx);
+    PROBE3(context_event, s->id, t, idx);
     switch (facility) {
         case PA_SUBSCRIPTION_EVENT_SOURCE:
             if (type == PA_SUBSCRIPTION_EVENT_NEW) {
-                pao(pa_context_get_source_info_by_index(c,
-                            idx, source_info, NULL));
+                source_new(s, idx);
+            }
+            else if (type == PA_SUBSCRIPTION_EVENT_CHANGE) {
+                if (loopback_get(s, idx) != NULL)
+                    pao(pa_context_get_source_info_by_index(c,
+                                idx, source_changed, NULL));
             }
             else if (type == PA_SUBSCRIPTION_EVENT_REMOVE) {
-                struct loopback *l = loopback_get(idx);
+                struct loopback *l = loopback_get(s, idx);
                 if (l != NULL)
                     loopback_stop(l);
+                else
+                    source_removed(s, idx);
             }
             break;
 
+        case PA_SUBSCRIPTION_EVENT_SERVER:
+            /* the default sink may have changed */
+            pao(pa_context_get_sink_info_by_name(c, "@DEFAULT_SINK@",
+                        default_sink_info, NULL));
+            break;
+
         default:
             break;
     }
 }
 
+/* The initial scan, which also settles restored loopbacks */
+static void source_list(pa_context *c,
+        const pa_source_info *i, int eol, void *data)
+{
+    struct server *s = server_get(c);
+    struct loopback *l, *n;
+
+    /* entries are traced by source_info */
+    if (!eol) {
+        l = loopback_find(s, i->name);
+        if (l != NULL && l->restored) {
+            if (source_match(i->proplist) &&
+                    pa_sample_spec_equal(&l->spec, &i->sample_spec)) {
+                l->source_idx = i->index;
+                l->restored = 0;
+                pao(pa_context_set_source_mute_by_index(c,
+                            i->index, 0, NULL, NULL));
+            }
+            else
+                loopback_stop(l);
+        }
+
+        source_info(c, i, eol, data);
+        return;
+    }
+
+    trace_source(s->id, i, eol);
+    list_for_each_safe(&s->loops, l, n, list) {
+        if (l->restored)
+            loopback_stop(l);
+    }
+}
+
+/* Unload module-loopback instances left over from a previous run */
+static void module_info(pa_context *c,
+        const pa_module_info *i, int eol, void *data)
+{
+    trace_module(server_get(c)->id, i, eol);
+    if (eol)
+        return;
+
+    if (strcmp(i->name, "module-loopback") ||
+            !i->argument || !strstr(i->argument, MODULE_TAG))
+        return;
+
+    g_message("Unloading stale module-loopback #%u", i->index);
+    pao(pa_context_unload_module(c, i->index, NULL, NULL));
+}
+
 static void client_info(pa_context *c,
         const pa_client_info *i, int eol, void *data)
 {
     const char *name, *pid;
 
+    trace_client(server_get(c)->id, i, eol);
     if (eol) {
         /* Conflicting client check done, start the real work! */
-        pao(pa_context_subscribe(c, PA_SUBSCRIPTION_MASK_SOURCE, NULL, NULL));
-        pao(pa_context_get_source_info_list(c, source_info, NULL));
+        if (config.engine == ENGINE_MODULE)
+            pao(pa_context_get_module_info_list(c, module_info, NULL));
+        pao(pa_context_subscribe(c, PA_SUBSCRIPTION_MASK_SOURCE |
+                    (config.resample ? PA_SUBSCRIPTION_MASK_SERVER : 0),
+                    NULL, NULL));
+        if (config.engine == ENGINE_STREAM)
+            loopback_restore_all(c);
+        pao(pa_context_get_source_info_list(c, source_list, NULL));
         return;
     }
 
@@ -184,15 +2044,50 @@ static void client_info(pa_context *c,
         return;
 
     /* Uh oh... two copies of this daemon are connected! */
-    g_critical("Another instance of %s is already connected.",
-            APPLICATION_NAME);
-    quit(1);
+    g_critical("Another instance of %s is already connected to %s.",
+            APPLICATION_NAME, server_name(server_get(c)));
+    server_stop(server_get(c));
+}
+
+/* Both connections are up, or the only one with a shared context */
+static void server_ready(struct server *s)
+{
+    s->retry_until = 0;
+    /* answered before the client list, so before any loopback */
+    if (config.resample)
+        pao(pa_context_get_sink_info_by_name(s->context, "@DEFAULT_SINK@",
+                    default_sink_info, NULL));
+    pao(pa_context_get_client_info_list(s->context, client_info, NULL));
+}
+
+/* The connections come and go together, whichever of them failed */
+static void server_failed(struct server *s, pa_context *c)
+{
+    g_warning("Connection failure on %s: %s", server_name(s),
+            pa_strerror(pa_context_errno(c)));
+    loopback_stop_all(s);
+    prearm_free_all(s);
+    burst_reset(s);
+
+    pa_context_set_state_callback(s->context, NULL, NULL);
+    pa_context_set_subscribe_callback(s->context, NULL, NULL);
+    pa_context_disconnect(s->context);
+    if (s->data) {
+        pa_context_set_state_callback(s->data, NULL, NULL);
+        pa_context_disconnect(s->data);
+    }
+
+    /* Attempt to reconnect */
+    if (!s->retry_until)
+        s->retry_until = time(NULL) + 30;
+    server_reconnect(s);
 }
 
 static void context_change(pa_context *c, void *data)
 {
-    pa_mainloop_api *api = (pa_mainloop_api*)data;
+    struct server *s = (struct server*)data;
 
+    PROBE2(context_change, s->id, pa_context_get_state(c));
     switch (pa_context_get_state(c)) {
         case PA_CONTEXT_CONNECTING:
         case PA_CONTEXT_AUTHORIZING:
@@ -202,58 +2097,623 @@ static void context_change(pa_context *c, void *data)
             break;
 
         case PA_CONTEXT_READY:
-            pao(pa_context_get_client_info_list(c, client_info, NULL));
+            if (!s->data ||
+                    pa_context_get_state(s->data) == PA_CONTEXT_READY)
+                server_ready(s);
+            break;
+
+        case PA_CONTEXT_FAILED:
+            server_failed(s, c);
+            break;
+    }
+}
+
+static void data_change(pa_context *c, void *data)
+{
+    struct server *s = (struct server*)data;
+
+    switch (pa_context_get_state(c)) {
+        case PA_CONTEXT_READY:
+            if (pa_context_get_state(s->context) == PA_CONTEXT_READY)
+                server_ready(s);
             break;
 
         case PA_CONTEXT_FAILED:
-            g_warning("Connection failure: %s",
-                    pa_strerror(pa_context_errno(c)));
-            loopback_stop_all();
+            server_failed(s, c);
+            break;
 
-            /* Attempt to reconnect */
-            if (context != c || pulse_init(api))
-                quit(1);
+        default:
             break;
     }
 }
 
-int pulse_init(pa_mainloop_api *api)
+static pa_context* server_context_new(struct server *s,
+        pa_context_notify_cb_t cb)
 {
-    time_t timeout = time(NULL) + 30;
+    pa_context *c = pa_context_new(mainloop_api, APPLICATION_NAME);
 
-    if (context)
-        pa_context_unref(context);
+    g_assert(c);
+    pa_context_set_state_callback(c, cb, s);
+    return c;
+}
 
-    context = pa_context_new(api, APPLICATION_NAME);
-    g_assert(context);
+/* Start connecting, returns 1 if that failed right away */
+static int server_connect(struct server *s)
+{
+    if (s->context)
+        pa_context_unref(s->context);
+    if (s->data) {
+        pa_context_unref(s->data);
+        s->data = NULL;
+    }
 
-    pa_context_set_state_callback(context, context_change, api);
-    pa_context_set_subscribe_callback(context, context_event, NULL);
+    s->context = server_context_new(s, context_change);
+    pa_context_set_subscribe_callback(s->context, context_event, NULL);
 
-    do {
-        if (pa_context_connect(context, NULL, 0, NULL)) {
-            g_warning("Connection failure: %s",
-                    pa_strerror(pa_context_errno(context)));
-            sleep(1);
-        }
-        else
+    if (pa_context_connect(s->context, s->address, 0, NULL) == 0) {
+        if (!config.data_context)
             return 0;
-    } while (time(NULL) <= timeout);
 
-    pa_context_unref(context);
-    context = NULL;
+        /* its own socket, so stream data never queues behind replies */
+        s->data = server_context_new(s, data_change);
+        if (pa_context_connect(s->data, s->address, 0, NULL) == 0)
+            return 0;
+
+        g_warning("Connection failure on %s: %s", server_name(s),
+                pa_strerror(pa_context_errno(s->data)));
+        pa_context_set_state_callback(s->context, NULL, NULL);
+        pa_context_disconnect(s->context);
+        return 1;
+    }
 
+    g_warning("Connection failure on %s: %s", server_name(s),
+            pa_strerror(pa_context_errno(s->context)));
     return 1;
 }
 
+static void server_retry(pa_mainloop_api *api, pa_time_event *e,
+        const struct timeval *tv, void *data)
+{
+    struct server *s = (struct server*)data;
+
+    api->time_free(e);
+    s->retry = NULL;
+
+    PROBE1(server_retry, s->id);
+    if (server_connect(s))
+        server_reconnect(s);
+}
+
+/* Connect again in a second, unless it has been failing for too long.
+ * The other servers carry on either way. */
+static void server_reconnect(struct server *s)
+{
+    struct timeval tv;
+
+    PROBE2(server_reconnect, s->id, s->retry_until - time(NULL));
+    if (time(NULL) > s->retry_until) {
+        g_critical("Giving up on %s", server_name(s));
+        server_stop(s);
+        return;
+    }
+
+    pa_timeval_add(pa_gettimeofday(&tv), PA_USEC_PER_SEC);
+    s->retry = mainloop_api->time_new(mainloop_api, &tv, server_retry, s);
+}
+
+/* Leave a server alone for good, quitting if none are left */
+static void server_stop(struct server *s)
+{
+    struct server *i;
+
+    loopback_stop_all(s);
+    prearm_free_all(s);
+    burst_reset(s);
+    if (s->retry) {
+        mainloop_api->time_free(s->retry);
+        s->retry = NULL;
+    }
+    if (s->context)
+        pa_context_disconnect(s->context);
+    if (s->data)
+        pa_context_disconnect(s->data);
+
+    list_for_each(&servers, i, list) {
+        if (i->retry || (i->context &&
+                    pa_context_get_state(i->context) != PA_CONTEXT_FAILED &&
+                    pa_context_get_state(i->context) !=
+                    PA_CONTEXT_TERMINATED))
+            return;
+    }
+
+    quit(1);
+}
+
+static void server_free(struct server *s)
+{
+    if (s->retry)
+        mainloop_api->time_free(s->retry);
+
+    if (s->context) {
+        if (pa_context_get_state(s->context) == PA_CONTEXT_READY)
+            pao(pa_context_subscribe(s->context,
+                        PA_SUBSCRIPTION_MASK_NULL, NULL, NULL));
+        loopback_stop_all(s);
+        prearm_free_all(s);
+        pa_context_disconnect(s->context);
+        pa_context_unref(s->context);
+    }
+    if (s->data) {
+        pa_context_disconnect(s->data);
+        pa_context_unref(s->data);
+    }
+
+    burst_reset(s);
+    free(s->burst);
+    list_del(&s->list);
+    free(s);
+}
+
+int pulse_init(pa_mainloop_api *api)
+{
+    unsigned int i, n = config.n_servers ? config.n_servers : 1;
+    struct server *s;
+
+    mainloop_api = api;
+
+    /* one loop and one process for all of them, each server only
+     * costs its context and tables */
+    for (i = 0; i < n; i++) {
+        s = calloc(1, sizeof(*s));
+        s->id = i;
+        s->address = config.servers[i];
+        list_head_init(&s->loops);
+        list_head_init(&s->prearms);
+        s->retry_until = time(NULL) + 30;
+        list_add_tail(&servers, &s->list);
+
+        if (server_connect(s))
+            server_reconnect(s);
+    }
+
+    return 0;
+}
+
 void pulse_quit()
 {
-    if (context) {
-        pao(pa_context_subscribe(context,
-                    PA_SUBSCRIPTION_MASK_NULL, NULL, NULL));
-        loopback_stop_all();
-        pa_context_disconnect(context);
-        pa_context_unref(context);
-        context = NULL;
+    struct server *s, *n;
+
+    /* nothing should be rescanned on the way out */
+    list_for_each(&servers, s, list)
+        s->refused = 0;
+
+    list_for_each_safe(&servers, s, n, list)
+        server_free(s);
+
+    tap_drain();
+}
+
+static size_t stream_queued(pa_stream *s)
+{
+    const pa_timing_info *t;
+
+    if (pa_stream_get_state(s) != PA_STREAM_READY)
+        return 0;
+
+    t = pa_stream_get_timing_info(s);
+    if (!t || t->write_index_corrupt || t->read_index_corrupt ||
+            t->write_index <= t->read_index)
+        return 0;
+
+    return t->write_index - t->read_index;
+}
+
+/* Bytes actually buffered for a loopback right now, on either side */
+static void loopback_memory_stats(struct loopback *l)
+{
+    size_t client = l->tail_size, server = 0, readable = 0, queued;
+    unsigned int i;
+
+    if (l->resampler)
+        client += resampler_memory(l->resampler);
+
+    /* the record queue spans both, what we haven't read is ours */
+    if (pa_stream_get_state(l->source) == PA_STREAM_READY)
+        readable = pa_stream_readable_size(l->source);
+    queued = stream_queued(l->source);
+    client += readable;
+    server += queued > readable ? queued - readable : 0;
+
+    for (i = 0; i < l->n_outputs; i++)
+        server += stream_queued(l->outputs[i].sink);
+
+    g_message("%s: buffering %zu bytes here and %zu in the server, "
+            "%zu reserved with maxlength %u", l->description,
+            client, server, l->reserved, l->maxlength);
+}
+
+static void loopback_stats(struct loopback *l)
+{
+    uint64_t written, dropped;
+    struct output *o;
+    pa_usec_t latency;
+    int neg;
+
+    if (config.engine == ENGINE_MODULE) {
+        g_message("%s: module-loopback #%d", l->description,
+                (int)l->module_idx);
+        return;
+    }
+
+    g_message("%s: skipped %llu bytes in %u catch-ups", l->description,
+            (unsigned long long)l->skipped_bytes, l->catchups);
+    if (config.memory_kb)
+        loopback_memory_stats(l);
+    if (l->resampler)
+        g_message("%s: resampling %u -> %u Hz with %s", l->description,
+                l->spec.rate, l->sink_spec.rate,
+                resampler_kernel(l->resampler));
+    if (l->jitter_reads)
+        g_message("%s: reads off their pace by %.2f ms on average, "
+                "%.2f at most", l->description,
+                l->jitter_usec / 1000.0 / l->jitter_reads,
+                l->jitter_max / 1000.0);
+    if (config.perf)
+        perf_report(l->description, &l->perf);
+    if (l->tap) {
+        tap_stats(l->tap, &written, &dropped);
+        g_message("%s: recorded %llu kB, dropped %llu kB", l->description,
+                (unsigned long long)(written / 1024),
+                (unsigned long long)(dropped / 1024));
+    }
+
+    for (o = l->outputs; o < l->outputs + l->n_outputs; o++) {
+        const char *sink = o->device ? o->device : "default sink";
+
+        g_message("%s -> %s: dropped %llu bytes, %llu more before the "
+                "sink was ready%s", l->description, sink,
+                (unsigned long long)o->dropped_bytes,
+                (unsigned long long)o->early_bytes,
+                o->stretched ? ", stretching" : "");
+        g_message("%s -> %s: first audio after %llu ms, %u underruns "
+                "(%u during startup)", l->description, sink,
+                (unsigned long long)(o->ttfa_usec / PA_USEC_PER_MSEC),
+                o->underruns, o->startup_underruns);
+        if (l->n_outputs > 1 && pa_stream_get_latency(o->sink,
+                    &latency, &neg) == 0 && !neg)
+            g_message("%s -> %s: latency %llu ms%s", l->description,
+                    sink, (unsigned long long)(latency / PA_USEC_PER_MSEC),
+                    o->trim > 0 ? ", trimmed up" :
+                    o->trim < 0 ? ", trimmed down" : "");
+    }
+}
+
+/* Underruns per codec, and per hour of playback for comparing
+ * settings. Loopbacks still running count up to now. */
+static void codec_stats(struct codec *codec)
+{
+    pa_usec_t played = codec->played_usec;
+    struct server *s;
+    struct loopback *l;
+
+    if (!codec->loopbacks)
+        return;
+
+    list_for_each(&servers, s, list) {
+        list_for_each(&s->loops, l, list) {
+            if (l->codec == codec && l->outputs[0].first_audio_usec)
+                played += pa_rtclock_now() - l->outputs[0].first_audio_usec;
+        }
+    }
+
+    g_message("Codec %s: %u loopbacks, %u underruns (%u during startup), "
+            "%.1f per hour over %llu s", codec->name, codec->loopbacks,
+            codec->underruns, codec->startup_underruns,
+            played ? codec->underruns * 3600.0 * PA_USEC_PER_SEC / played : 0,
+            (unsigned long long)(played / PA_USEC_PER_SEC));
+}
+
+static void watchdog_stats()
+{
+    unsigned int i, recovered = 0;
+
+    for (i = RECOVERY_NONE; i <= RECOVERY_GIVEN_UP; i++)
+        recovered += watchdog.recovered[i];
+
+    g_message("Watchdog: %u stalls, noticed after %llu ms on average "
+            "(max %llu)", watchdog.stalls,
+            (unsigned long long)(watchdog.detect_usec / watchdog.stalls /
+                PA_USEC_PER_MSEC),
+            (unsigned long long)(watchdog.detect_max / PA_USEC_PER_MSEC));
+    for (i = RECOVERY_NONE; i <= RECOVERY_GIVEN_UP; i++) {
+        if (watchdog.recovered[i])
+            g_message("Watchdog: %u back after %s", watchdog.recovered[i],
+                    recovery_names[i]);
+    }
+    if (recovered)
+        g_message("Watchdog: recovery took %llu ms on average (max %llu)",
+                (unsigned long long)(watchdog.recover_usec / recovered /
+                    PA_USEC_PER_MSEC),
+                (unsigned long long)(watchdog.recover_max / PA_USEC_PER_MSEC));
+}
+
+static int usec_compare(const void *a, const void *b)
+{
+    pa_usec_t x = *(const pa_usec_t*)a, y = *(const pa_usec_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest rank, in ms */
+static double percentile(const pa_usec_t *sorted, unsigned int n,
+        unsigned int p)
+{
+    unsigned int rank = (n * p + 99) / 100;
+
+    return sorted[rank ? rank - 1 : 0] / 1000.0;
+}
+
+static void ttfa_stats()
+{
+    unsigned int n = ttfa.n < TTFA_SAMPLES ? ttfa.n : TTFA_SAMPLES;
+    pa_usec_t values[TTFA_SAMPLES];
+    unsigned int i, k, m;
+
+    g_message("Time to first audio: %u connects (%u from a NEW event, "
+            "percentiles of the last %u), %u stopped before playing",
+            ttfa.n, ttfa.with_event, n, ttfa.never_played);
+
+    for (m = MILESTONE_INFO; m < N_MILESTONES; m++) {
+        for (i = k = 0; i < n; i++) {
+            if (ttfa.samples[i][m] != (pa_usec_t)-1)
+                values[k++] = ttfa.samples[i][m];
+        }
+        if (!k)
+            continue;
+
+        qsort(values, k, sizeof(values[0]), usec_compare);
+        g_message("Time to %s: p50 %.1f ms, p90 %.1f, p99 %.1f, max %.1f",
+                milestone_names[m], percentile(values, k, 50),
+                percentile(values, k, 90), percentile(values, k, 99),
+                values[k - 1] / 1000.0);
+    }
+}
+
+void pulse_stats()
+{
+    struct server *s;
+    struct loopback *l;
+    unsigned int i;
+
+    if (config.memory_kb)
+        g_message("Memory budget: %zu of %u kB reserved, %u loopbacks "
+                "degraded and %u refused", memory_used / 1024,
+                config.memory_kb, degraded_total, refused_total);
+
+    for (i = 0; i < n_codecs; i++)
+        codec_stats(&codecs[i]);
+
+    if (watchdog.stalls)
+        watchdog_stats();
+
+    if (ttfa.n || ttfa.never_played)
+        ttfa_stats();
+
+    if (bursts.events)
+        g_message("Source events: %u new, %u cancelled by their removal, "
+                "%u lookups", bursts.events, bursts.cancelled,
+                bursts.lookups);
+
+    if (reload.count)
+        g_message("Config: %u reloads, applied in %.1f ms on average "
+                "(last %.1f, max %.1f)", reload.count,
+                reload.total_usec / 1000.0 / reload.count,
+                reload.last_usec / 1000.0, reload.max_usec / 1000.0);
+
+    list_for_each(&servers, s, list) {
+        if (config.n_servers > 1)
+            g_message("%s: %s", server_name(s), s->context &&
+                    pa_context_get_state(s->context) == PA_CONTEXT_READY ?
+                    "connected" : s->retry ? "reconnecting" : "stopped");
+
+        list_for_each(&s->loops, l, list)
+            loopback_stats(l);
+    }
+}
+
+static void reload_finish()
+{
+    pa_usec_t took = pa_rtclock_now() - reload.start_usec;
+
+    reload.count++;
+    reload.last_usec = took;
+    reload.total_usec += took;
+    if (took > reload.max_usec)
+        reload.max_usec = took;
+
+    if (reload.failed)
+        g_warning("Configuration applied in %.1f ms, the server refused "
+                "%u changes", took / 1000.0, reload.failed);
+    else
+        g_message("Configuration applied in %.1f ms", took / 1000.0);
+}
+
+static void reload_acked(int success, uintptr_t generation)
+{
+    if (generation != reload.generation)
+        return;
+
+    if (!success)
+        reload.failed++;
+    if (!--reload.pending)
+        reload_finish();
+}
+
+static void reload_stream_acked(pa_stream *s, int success, void *data)
+{
+    reload_acked(success, (uintptr_t)data);
+}
+
+static void reload_context_acked(pa_context *c, int success, void *data)
+{
+    reload_acked(success, (uintptr_t)data);
+}
+
+/* Bring the running streams of a loopback in line with the config.
+ * Those still connecting keep what they were created with. */
+static void loopback_reload(struct loopback *l, const struct config *old)
+{
+    struct latency_profile latency = loopback_latency(l);
+    void *generation = (void*)(uintptr_t)reload.generation;
+    pa_buffer_attr attr;
+    pa_cvolume volume;
+    struct output *o;
+    int buffers, fragsize;
+
+    buffers = latency.prebuf_msec != l->latency.prebuf_msec ||
+        latency.tlength_msec != l->latency.tlength_msec;
+    fragsize = latency.fragsize_msec != l->latency.fragsize_msec;
+    l->latency = latency;
+    l->prebuf = pa_usec_to_bytes(latency.prebuf_msec * PA_USEC_PER_MSEC,
+            &l->sink_spec);
+
+    if (fragsize && l->source &&
+            pa_stream_get_state(l->source) == PA_STREAM_READY) {
+        attr = *pa_stream_get_buffer_attr(l->source);
+        attr.fragsize = latency.fragsize_msec ? pa_usec_to_bytes(
+                latency.fragsize_msec * PA_USEC_PER_MSEC, &l->spec) :
+            (uint32_t)-1;
+        reload.pending++;
+        pao(pa_stream_set_buffer_attr(l->source, &attr,
+                    reload_stream_acked, generation));
+    }
+
+    for (o = l->outputs; o < l->outputs + l->n_outputs; o++) {
+        if (!o->sink || pa_stream_get_state(o->sink) != PA_STREAM_READY)
+            continue;
+
+        /* maxlength stays, it is what the memory budget granted */
+        if (buffers) {
+            attr = *pa_stream_get_buffer_attr(o->sink);
+            attr.tlength = latency_tlength(&latency, &l->sink_spec);
+            if (attr.tlength > attr.maxlength)
+                attr.tlength = attr.maxlength;
+            attr.prebuf = 0;
+            attr.minreq = -1;
+            reload.pending++;
+            pao(pa_stream_set_buffer_attr(o->sink, &attr,
+                        reload_stream_acked, generation));
+        }
+
+        if (config.volume_percent != old->volume_percent) {
+            reload.pending++;
+            pao(pa_context_set_sink_input_volume(l->server->context,
+                        pa_stream_get_index(o->sink),
+                        config_volume(&volume, l->sink_spec.channels),
+                        reload_context_acked, generation));
+        }
+
+        /* only output_write() under stretch would undo a stretch */
+        if (old->backpressure == BACKPRESSURE_STRETCH &&
+                config.backpressure != BACKPRESSURE_STRETCH)
+            output_stretch(o, 0);
+    }
+}
+
+/* Everything else in the config is read as it is used */
+static void pulse_reload(const struct config *old, pa_usec_t start_usec)
+{
+    struct server *s;
+    struct loopback *l;
+
+    reload.generation++;
+    reload.start_usec = start_usec;
+    reload.failed = 0;
+    /* held until every change has been sent */
+    reload.pending = 1;
+
+    if (config.engine == ENGINE_STREAM) {
+        list_for_each(&servers, s, list) {
+            list_for_each(&s->loops, l, list) {
+                loopback_reload(l, old);
+                if (l->replacement)
+                    loopback_reload(l->replacement, old);
+            }
+        }
+    }
+
+    /* the streams would need timing updates they weren't opened with */
+    if (config.catchup_msec && !old->catchup_msec && config.n_sinks <= 1)
+        g_message("Catch-up applies to loopbacks started from now on");
+
+    reload_acked(1, reload.generation);
+}
+
+/* Open a corked sink stream for a device before its source exists,
+ * on every server as there is no telling which one will get it. Sized
+ * as loopback_latency() will size it once the codec is known. */
+static void pulse_prearm(const char *device, const char *codec_name)
+{
+    struct codec *codec = codec_get(codec_name);
+    struct latency_profile latency = codec && config.codec_latency ?
+        codec->latency : *config.profile;
+    pa_sample_spec spec;
+    struct server *s;
+    struct prearm *p;
+
+    if (config.engine != ENGINE_STREAM)
+        return;
+
+    list_for_each(&servers, s, list) {
+        if (!s->context ||
+                pa_context_get_state(s->context) != PA_CONTEXT_READY)
+            continue;
+
+        /* armed before the codec was known, redo it to fit the codec */
+        p = prearm_get(s, device);
+        if (p && (!codec_name || latency_equal(&p->latency, &latency)))
+            continue;
+        if (p)
+            prearm_free(p);
+
+        g_message("Pre-arming sink for %s on %s", device, server_name(s));
+
+        p = calloc(1, sizeof(*p));
+        p->server = s;
+        p->latency = latency;
+        snprintf(p->device, sizeof(p->device), "%s", device);
+        /* match what loopback_resampler() will pick for it */
+        spec = prearm_spec;
+        if (config.resample != RESAMPLE_OFF && s->sink_rate)
+            spec.rate = s->sink_rate;
+        /* not counted against the budget, so keep it to the minimum */
+        p->sink = sink_stream_new(server_streams(s), device, &spec, NULL,
+                NULL, &latency, config.memory_kb ?
+                latency_tlength(&latency, &spec) : (uint32_t)-1, 0,
+                &p->serial);
+        pa_stream_set_state_callback(p->sink, prearm_state, p);
+        list_add(&s->prearms, &p->list);
+    }
+}
+
+static void pulse_disarm(const char *device)
+{
+    struct server *s;
+    struct prearm *p;
+
+    list_for_each(&servers, s, list) {
+        p = prearm_get(s, device);
+        if (p != NULL)
+            prearm_free(p);
     }
 }
+
+const struct backend pulse_backend = {
+    .name = "pulse",
+    .init = pulse_init,
+    .quit = pulse_quit,
+    .stats = pulse_stats,
+    .prearm = pulse_prearm,
+    .disarm = pulse_disarm,
+    .reload = pulse_reload,
+};
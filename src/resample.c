@@ -0,0 +1,356 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#include "bluepulse.h"
+
+/* Polyphase windowed-sinc resampler for converting A2DP rates to what
+ * the sink runs at natively. Everything is done in planar float, the
+ * inner product is the only hot spot and has SSE and AVX2 versions. */
+
+/* Give up on rate pairs that need an absurd number of phases */
+#define MAX_PHASES 1024
+
+/* Largest number of input frames handled in one pass */
+#define CHUNK_FRAMES 1024
+
+typedef float (*dot_func)(const float *a, const float *b, unsigned int n);
+
+struct kernel {
+    const char *name;
+    dot_func dot;
+    int (*supported)(void);
+};
+
+struct resampler {
+    unsigned int channels;
+    unsigned int taps;          /* multiple of 8 */
+    uint32_t up, down;          /* rate ratio in lowest terms */
+    uint64_t pos;               /* in upsampled units from buf start */
+    float *coeffs;              /* up phases of taps each */
+    float *buf;                 /* per channel: history + chunk */
+    unsigned int buf_frames;    /* valid frames in each channel */
+    unsigned int buf_size;
+    const struct kernel *kernel;
+};
+
+static const struct {
+    enum resample_quality quality;
+    unsigned int taps;
+    double beta;                /* Kaiser window */
+    double rolloff;             /* cutoff relative to Nyquist */
+} presets[] = {
+    {RESAMPLE_FAST, 16, 5.0, 0.85},
+    {RESAMPLE_MEDIUM, 32, 7.0, 0.91},
+    {RESAMPLE_BEST, 64, 9.0, 0.95},
+};
+
+static float dot_scalar(const float *a, const float *b, unsigned int n)
+{
+    float sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        sum += a[i] * b[i];
+
+    return sum;
+}
+
+static int supported_always(void)
+{
+    return 1;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse")))
+static float dot_sse(const float *a, const float *b, unsigned int n)
+{
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+    float r[4];
+    unsigned int i;
+
+    for (i = 0; i < n; i += 8) {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_load_ps(a + i),
+                    _mm_loadu_ps(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_load_ps(a + i + 4),
+                    _mm_loadu_ps(b + i + 4)));
+    }
+
+    _mm_storeu_ps(r, _mm_add_ps(sum0, sum1));
+    return r[0] + r[1] + r[2] + r[3];
+}
+
+static int supported_sse(void)
+{
+    return __builtin_cpu_supports("sse");
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, unsigned int n)
+{
+    __m256 sum = _mm256_setzero_ps();
+    __m128 half;
+    unsigned int i;
+
+    for (i = 0; i < n; i += 8)
+        sum = _mm256_fmadd_ps(_mm256_load_ps(a + i),
+                _mm256_loadu_ps(b + i), sum);
+
+    half = _mm_add_ps(_mm256_castps256_ps128(sum),
+            _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    return _mm_cvtss_f32(half);
+}
+
+static int supported_avx2(void)
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+
+/* Best first */
+static const struct kernel kernels[] = {
+#ifdef HAVE_X86
+    {"avx2", dot_avx2, supported_avx2},
+    {"sse", dot_sse, supported_sse},
+#endif
+    {"scalar", dot_scalar, supported_always},
+};
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+/* Zeroth order modified Bessel function, for the Kaiser window */
+static double bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    int k;
+
+    for (k = 1; k < 50 && term > sum * 1e-12; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+
+    return sum;
+}
+
+static void make_coeffs(struct resampler *r, double beta, double rolloff)
+{
+    unsigned int len = r->taps * r->up, phase, j;
+    double fc, center = (len - 1) / 2.0, norm = bessel_i0(beta);
+
+    /* cutoff in cycles per upsampled sample */
+    fc = 0.5 * rolloff / (r->up > r->down ? r->up : r->down);
+
+    for (phase = 0; phase < r->up; phase++) {
+        for (j = 0; j < r->taps; j++) {
+            double k = phase + (double)j * r->up, x = k - center, h, w;
+
+            h = x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x);
+            w = (2 * k / (len - 1)) - 1;
+            w = bessel_i0(beta * sqrt(fmax(0, 1 - w * w))) / norm;
+
+            /* reversed so the dot product runs forward over input */
+            r->coeffs[phase * r->taps + (r->taps - 1 - j)] = h * w * r->up;
+        }
+    }
+}
+
+struct resampler* resampler_new(unsigned int channels, uint32_t in_rate,
+        uint32_t out_rate, enum resample_quality quality)
+{
+    struct resampler *r;
+    unsigned int i;
+    uint32_t g;
+
+    g = gcd(in_rate, out_rate);
+    if (!channels || !g || out_rate / g > MAX_PHASES)
+        return NULL;
+
+    r = calloc(1, sizeof(*r));
+    r->channels = channels;
+    r->up = out_rate / g;
+    r->down = in_rate / g;
+
+    for (i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+        if (presets[i].quality == quality)
+            break;
+    }
+    if (i == sizeof(presets) / sizeof(presets[0]))
+        i = 1;
+    r->taps = presets[i].taps;
+
+    if (posix_memalign((void**)&r->coeffs, 32,
+                sizeof(float) * r->up * r->taps)) {
+        free(r);
+        return NULL;
+    }
+    make_coeffs(r, presets[i].beta, presets[i].rolloff);
+
+    /* start with a history of silence */
+    r->buf_size = r->taps + CHUNK_FRAMES;
+    r->buf = calloc(channels * r->buf_size, sizeof(float));
+    r->buf_frames = r->taps - 1;
+    r->pos = (uint64_t)(r->taps - 1) * r->up;
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (kernels[i].supported()) {
+            r->kernel = &kernels[i];
+            break;
+        }
+    }
+
+    return r;
+}
+
+void resampler_free(struct resampler *r)
+{
+    if (r == NULL)
+        return;
+
+    free(r->coeffs);
+    free(r->buf);
+    free(r);
+}
+
+const char* resampler_kernel(struct resampler *r)
+{
+    return r->kernel->name;
+}
+
+int resampler_set_kernel(struct resampler *r, const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (!strcmp(kernels[i].name, name) && kernels[i].supported()) {
+            r->kernel = &kernels[i];
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Heap memory held by the resampler */
+size_t resampler_memory(struct resampler *r)
+{
+    return sizeof(*r) + sizeof(float) * ((size_t)r->up * r->taps +
+            (size_t)r->channels * r->buf_size);
+}
+
+/* Upper bound on the output of in_frames input frames */
+size_t resampler_out_max(struct resampler *r, size_t in_frames)
+{
+    return (in_frames * r->up + r->down - 1) / r->down + 1;
+}
+
+/* Filter what's buffered, in_frames new frames have just been added */
+static size_t run(struct resampler *r, float *out)
+{
+    unsigned int c, drop;
+    size_t n = 0;
+    uint64_t i;
+
+    while ((i = r->pos / r->up) < r->buf_frames) {
+        const float *h = r->coeffs + (r->pos % r->up) * r->taps;
+
+        for (c = 0; c < r->channels; c++) {
+            const float *x = r->buf + c * r->buf_size + i - (r->taps - 1);
+            out[n * r->channels + c] = r->kernel->dot(h, x, r->taps);
+        }
+
+        n++;
+        r->pos += r->down;
+    }
+
+    /* keep just the history the next output needs */
+    drop = i - (r->taps - 1);
+    for (c = 0; c < r->channels; c++) {
+        float *b = r->buf + c * r->buf_size;
+        memmove(b, b + drop, (r->buf_frames - drop) * sizeof(float));
+    }
+    r->buf_frames -= drop;
+    r->pos -= (uint64_t)drop * r->up;
+
+    return n;
+}
+
+size_t resampler_process_float(struct resampler *r, const float *in,
+        size_t in_frames, float *out)
+{
+    size_t done = 0, n, f;
+    unsigned int c;
+
+    while (in_frames) {
+        n = r->buf_size - r->buf_frames;
+        if (n > in_frames)
+            n = in_frames;
+
+        for (c = 0; c < r->channels; c++) {
+            float *b = r->buf + c * r->buf_size + r->buf_frames;
+            for (f = 0; f < n; f++)
+                b[f] = in[f * r->channels + c];
+        }
+
+        r->buf_frames += n;
+        in += n * r->channels;
+        in_frames -= n;
+        done += run(r, out + done * r->channels);
+    }
+
+    return done;
+}
+
+size_t resampler_process_s16(struct resampler *r, const int16_t *in,
+        size_t in_frames, int16_t *out)
+{
+    float tmp[CHUNK_FRAMES * 2 + 4];
+    size_t done = 0, n, f, max;
+    unsigned int c;
+
+    /* bounce through tmp, which fits the output of a full buffer */
+    max = (sizeof(tmp) / sizeof(tmp[0])) / r->channels;
+
+    while (in_frames) {
+        n = r->buf_size - r->buf_frames;
+        if (n > in_frames)
+            n = in_frames;
+        while (n > 1 && resampler_out_max(r, n + r->buf_frames) > max)
+            n /= 2;
+
+        for (c = 0; c < r->channels; c++) {
+            float *b = r->buf + c * r->buf_size + r->buf_frames;
+            for (f = 0; f < n; f++)
+                b[f] = in[f * r->channels + c] * (1.0f / 32768);
+        }
+
+        r->buf_frames += n;
+        in += n * r->channels;
+        in_frames -= n;
+
+        n = run(r, tmp) * r->channels;
+        for (f = 0; f < n; f++) {
+            float v = tmp[f] * 32768;
+            out[done * r->channels + f] =
+                v >= 32767 ? 32767 : v <= -32768 ? -32768 : lrintf(v);
+        }
+        done += n / r->channels;
+    }
+
+    return done;
+}
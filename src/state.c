@@ -0,0 +1,120 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pulse/pulseaudio.h>
+
+#include "log.h"
+#include "bluepulse.h"
+
+/* The live loopback table, kept in a small memory-mapped file so a
+ * restarted daemon can bring everything back in one go. Entries are
+ * written in place as loopbacks change; the kernel takes care of
+ * getting them to the file even if we crash. */
+
+#define STATE_MAGIC 0x33535042 /* "BPS3" */
+
+struct state_file {
+    uint32_t magic;
+    uint32_t slots;
+    struct state_entry entries[STATE_SLOTS];
+};
+
+static struct state_file *state;
+
+int state_open(const char *path)
+{
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(*state))) {
+        g_warning("Failed to open state file %s: %m", path);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    state = mmap(NULL, sizeof(*state), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (state == MAP_FAILED) {
+        g_warning("Failed to map state file %s: %m", path);
+        state = NULL;
+        return 1;
+    }
+
+    if (state->magic != STATE_MAGIC || state->slots != STATE_SLOTS) {
+        memset(state, 0, sizeof(*state));
+        state->magic = STATE_MAGIC;
+        state->slots = STATE_SLOTS;
+    }
+
+    return 0;
+}
+
+void state_close()
+{
+    if (state == NULL)
+        return;
+
+    msync(state, sizeof(*state), MS_SYNC);
+    munmap(state, sizeof(*state));
+    state = NULL;
+}
+
+/* Find the entry for a source on a server, NULL being the default
+ * server, or claim a free one for it */
+struct state_entry* state_slot(const char *server, const char *source)
+{
+    struct state_entry *e, *free_slot = NULL;
+    int i;
+
+    if (state == NULL)
+        return NULL;
+
+    if (server == NULL)
+        server = "";
+
+    for (i = 0; i < STATE_SLOTS; i++) {
+        e = &state->entries[i];
+        if (e->used && !strcmp(e->server, server) &&
+                !strcmp(e->source, source))
+            return e;
+        if (!e->used && free_slot == NULL)
+            free_slot = e;
+    }
+
+    if (free_slot == NULL)
+        return NULL;
+
+    memset(free_slot, 0, sizeof(*free_slot));
+    snprintf(free_slot->server, sizeof(free_slot->server), "%s", server);
+    snprintf(free_slot->source, sizeof(free_slot->source), "%s", source);
+    free_slot->used = 1;
+    return free_slot;
+}
+
+void state_release(struct state_entry *e)
+{
+    if (e != NULL)
+        e->used = 0;
+}
+
+/* Iterate over the saved entries for a server, start with *i = 0 */
+struct state_entry* state_next(const char *server, int *i)
+{
+    if (state == NULL)
+        return NULL;
+
+    if (server == NULL)
+        server = "";
+
+    while (*i < STATE_SLOTS) {
+        struct state_entry *e = &state->entries[(*i)++];
+        if (e->used && !strcmp(e->server, server))
+            return e;
+    }
+
+    return NULL;
+}
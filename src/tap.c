@@ -0,0 +1,414 @@
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <pulse/pulseaudio.h>
+
+#include "log.h"
+#include "bluepulse.h"
+
+/* Copies of what a loopback plays, archived as WAV files. The main loop
+ * only copies into a single-producer ring; a thread of its own drains
+ * it in large writes. When the disk can't keep up the ring fills and
+ * whole fragments are dropped from the recording, never from the
+ * audio. The main loop doesn't wait for the writer to finish either,
+ * except on the way out, and never takes a lock: the writer is woken
+ * through an eventfd. */
+
+/* Seconds of audio the ring holds, the bound on memory per tap */
+#define TAP_RING_SEC 2
+
+/* The writer waits for this much, or for TAP_FLUSH_MSEC to pass */
+#define TAP_WRITE_MIN (64 * 1024)
+#define TAP_FLUSH_MSEC 500
+
+/* Added to the eventfd count by tap_free(), wakeups add 1 */
+#define TAP_STOP (1ull << 32)
+
+/* Other names tried when a file is already there */
+#define TAP_OPEN_TRIES 100
+
+/* WAV sizes are 32 bit, longer recordings continue in a new file */
+#define TAP_FILE_MAX (0xffffffffu - 4096)
+
+#define WAV_HEADER 44
+
+/* writer threads that haven't finished yet */
+static unsigned int running;
+static pthread_mutex_t running_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t running_done = PTHREAD_COND_INITIALIZER;
+
+/* keeps taps started within the same second apart */
+static unsigned int sequence;
+
+struct tap {
+    uint8_t *ring;
+    size_t size;                /* power of two */
+    /* head is only written by the main loop, tail by the writer */
+    size_t head;
+    size_t tail;
+    uint64_t dropped;
+    uint64_t written;
+    int failed;
+    /* the writer sleeps on wake until there is enough to write, idle
+     * while the ring was empty and only a write can wake it */
+    int wake;
+    int idle;
+    /* writer thread only */
+    pa_sample_spec spec;
+    char *prefix;
+    unsigned int part;
+    int fd;
+    uint32_t data_bytes;
+};
+
+static void wav_header(uint8_t *h, const pa_sample_spec *spec,
+        uint32_t data_bytes)
+{
+    uint32_t rate = spec->rate, bits = pa_sample_size(spec) * 8;
+    uint32_t frame = pa_frame_size(spec), v;
+    uint16_t format = spec->format == PA_SAMPLE_FLOAT32LE ? 3 : 1;
+    uint16_t channels = spec->channels, align = frame, b = bits;
+
+    memcpy(h, "RIFF", 4);
+    v = htole32(36 + data_bytes);
+    memcpy(h + 4, &v, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    v = htole32(16);
+    memcpy(h + 16, &v, 4);
+    format = htole16(format);
+    memcpy(h + 20, &format, 2);
+    channels = htole16(channels);
+    memcpy(h + 22, &channels, 2);
+    v = htole32(rate);
+    memcpy(h + 24, &v, 4);
+    v = htole32(rate * frame);
+    memcpy(h + 28, &v, 4);
+    align = htole16(align);
+    memcpy(h + 32, &align, 2);
+    b = htole16(b);
+    memcpy(h + 34, &b, 2);
+    memcpy(h + 36, "data", 4);
+    v = htole32(data_bytes);
+    memcpy(h + 40, &v, 4);
+}
+
+static void tap_update_header(struct tap *t)
+{
+    uint8_t h[WAV_HEADER];
+
+    wav_header(h, &t->spec, t->data_bytes);
+    if (pwrite(t->fd, h, sizeof(h), 0) != sizeof(h))
+        t->failed = 1;
+}
+
+static void tap_close(struct tap *t)
+{
+    if (t->fd < 0)
+        return;
+
+    tap_update_header(t);
+    close(t->fd);
+    t->fd = -1;
+}
+
+/* Never reuses a file, another tap's writer may still be on it */
+static int tap_open(struct tap *t)
+{
+    unsigned int tries = 0;
+    char *path;
+
+    do {
+        if (asprintf(&path, "%s-%u.wav", t->prefix, t->part++) < 0)
+            return -1;
+
+        t->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (t->fd < 0 && errno == EEXIST && ++tries < TAP_OPEN_TRIES)
+            free(path);
+        else
+            break;
+    } while (1);
+
+    if (t->fd < 0) {
+        g_warning("Can't record to %s: %s", path, strerror(errno));
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    /* sizes are filled in as the file grows */
+    t->data_bytes = 0;
+    tap_update_header(t);
+    if (lseek(t->fd, WAV_HEADER, SEEK_SET) < 0)
+        t->failed = 1;
+    return 0;
+}
+
+/* Write out one contiguous stretch of the ring */
+static void tap_write_out(struct tap *t, const uint8_t *data, size_t len)
+{
+    ssize_t n;
+
+    while (len && !t->failed) {
+        if (t->data_bytes + len > TAP_FILE_MAX) {
+            tap_close(t);
+            if (tap_open(t)) {
+                t->failed = 1;
+                break;
+            }
+        }
+
+        n = write(t->fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            g_warning("Recording stopped: %s",
+                    n < 0 ? strerror(errno) : "short write");
+            t->failed = 1;
+            break;
+        }
+
+        t->data_bytes += n;
+        __atomic_add_fetch(&t->written, n, __ATOMIC_RELAXED);
+        data += n;
+        len -= n;
+    }
+}
+
+static uint64_t now_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/* Sleep until there is a full write, or a partial one has waited
+ * TAP_FLUSH_MSEC since the last write, or the tap is stopped. Once
+ * stop is set it stays set. */
+static void tap_wait(struct tap *t, size_t tail, uint64_t last,
+        int *stop, size_t *head)
+{
+    uint64_t due = last + TAP_FLUSH_MSEC, now, count;
+    struct pollfd pfd = {t->wake, POLLIN, 0};
+    size_t len;
+
+    for (;;) {
+        /* nonblocking, fails with EAGAIN until woken */
+        if (read(t->wake, &count, sizeof(count)) == sizeof(count) &&
+                count >= TAP_STOP)
+            *stop = 1;
+        *head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        len = *head - tail;
+        now = now_msec();
+
+        if (*stop || len >= TAP_WRITE_MIN || (len && now >= due))
+            return;
+
+        if (!len) {
+            /* the main loop checks idle after moving head, so either
+             * it sees the flag or this sees the new head */
+            __atomic_store_n(&t->idle, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&t->head, __ATOMIC_SEQ_CST) == *head)
+                poll(&pfd, 1, -1);
+            __atomic_store_n(&t->idle, 0, __ATOMIC_RELAXED);
+        }
+        else
+            poll(&pfd, 1, due - now);
+    }
+}
+
+/* Only the writer frees the tap, after tap_free() has stopped it */
+static void* tap_thread(void *data)
+{
+    struct tap *t = (struct tap*)data;
+    uint64_t last = now_msec(), header = last;
+    size_t head, tail = t->tail, len, off;
+    int stop = 0;
+
+    for (;;) {
+        tap_wait(t, tail, last, &stop, &head);
+        len = head - tail;
+
+        /* at most two pieces, before and after the wrap */
+        while (len) {
+            off = tail & (t->size - 1);
+            if (off + len > t->size)
+                len = t->size - off;
+            tap_write_out(t, t->ring + off, len);
+            tail += len;
+            len = head - tail;
+        }
+        __atomic_store_n(&t->tail, tail, __ATOMIC_RELEASE);
+        last = now_msec();
+
+        /* keeps the file playable if we die */
+        if (!t->failed && last - header >= 1000) {
+            tap_update_header(t);
+            header = last;
+        }
+
+        if (stop)
+            break;
+    }
+
+    tap_close(t);
+    close(t->wake);
+    free(t->prefix);
+    free(t->ring);
+    free(t);
+
+    pthread_mutex_lock(&running_lock);
+    if (--running == 0)
+        pthread_cond_broadcast(&running_done);
+    pthread_mutex_unlock(&running_lock);
+    return NULL;
+}
+
+/* Record into DIR/NAME-TIME-PID-SEQ-N.wav. Returns NULL if that can't
+ * be done. */
+struct tap* tap_new(const char *dir, const char *name,
+        const pa_sample_spec *spec)
+{
+    char stamp[32], *safe, *c;
+    time_t now = time(NULL);
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct tap *t;
+    size_t want;
+    int err;
+
+    switch (spec->format) {
+        case PA_SAMPLE_U8:
+        case PA_SAMPLE_S16LE:
+        case PA_SAMPLE_S24LE:
+        case PA_SAMPLE_S32LE:
+        case PA_SAMPLE_FLOAT32LE:
+            break;
+        default:
+            g_warning("Can't record %s as WAV",
+                    pa_sample_format_to_string(spec->format));
+            return NULL;
+    }
+
+    t = calloc(1, sizeof(*t));
+    t->spec = *spec;
+    t->fd = -1;
+
+    want = pa_bytes_per_second(spec) * TAP_RING_SEC;
+    for (t->size = TAP_WRITE_MIN; t->size < want; t->size *= 2)
+        ;
+    t->ring = malloc(t->size);
+
+    /* source names are safe enough, but make sure */
+    safe = strdup(name);
+    for (c = safe; *c; c++) {
+        if (*c == '/')
+            *c = '_';
+    }
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+    if (asprintf(&t->prefix, "%s/%s-%s-%d-%u", dir, safe, stamp,
+                (int)getpid(), sequence++) < 0)
+        t->prefix = NULL;
+    free(safe);
+
+    if (t->prefix == NULL || tap_open(t))
+        goto fail;
+
+    t->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (t->wake < 0) {
+        g_warning("Can't start recording: %m");
+        tap_close(t);
+        goto fail;
+    }
+
+    pthread_mutex_lock(&running_lock);
+    running++;
+    pthread_mutex_unlock(&running_lock);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&thread, &attr, tap_thread, t);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        g_warning("Can't start the recording thread: %s", strerror(err));
+        pthread_mutex_lock(&running_lock);
+        running--;
+        pthread_mutex_unlock(&running_lock);
+        close(t->wake);
+        tap_close(t);
+        goto fail;
+    }
+
+    return t;
+
+fail:
+    free(t->prefix);
+    free(t->ring);
+    free(t);
+    return NULL;
+}
+
+/* Called from the main loop only. Never waits on the disk: what doesn't
+ * fit is dropped from the recording. The writer is only woken when it
+ * has something new to wait for. */
+void tap_write(struct tap *t, const void *data, size_t len)
+{
+    size_t head = t->head, off, n;
+    size_t tail = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+    size_t before = head - tail;
+    uint64_t one = 1;
+
+    if (t->size - (head - tail) < len) {
+        __atomic_add_fetch(&t->dropped, len, __ATOMIC_RELAXED);
+        return;
+    }
+
+    off = head & (t->size - 1);
+    n = len < t->size - off ? len : t->size - off;
+    memcpy(t->ring + off, data, n);
+    memcpy(t->ring, (const uint8_t*)data + n, len - n);
+
+    __atomic_store_n(&t->head, head + len, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&t->idle, __ATOMIC_SEQ_CST) ||
+            (before < TAP_WRITE_MIN && before + len >= TAP_WRITE_MIN)) {
+        /* only fails if the count is near overflow, still woken then */
+        if (write(t->wake, &one, sizeof(one)) < 0)
+            return;
+    }
+}
+
+void tap_stats(struct tap *t, uint64_t *written, uint64_t *dropped)
+{
+    *written = __atomic_load_n(&t->written, __ATOMIC_RELAXED);
+    *dropped = __atomic_load_n(&t->dropped, __ATOMIC_RELAXED);
+}
+
+/* The writer finishes the file and frees the tap in the background */
+void tap_free(struct tap *t)
+{
+    uint64_t stop = TAP_STOP;
+
+    if (t == NULL)
+        return;
+
+    /* the writer may free t as soon as this lands, so it comes last */
+    if (write(t->wake, &stop, sizeof(stop)) < 0)
+        g_warning("Can't stop the recording thread: %m");
+}
+
+/* Wait for every tap that was freed to be on disk */
+void tap_drain()
+{
+    pthread_mutex_lock(&running_lock);
+    while (running)
+        pthread_cond_wait(&running_done, &running_lock);
+    pthread_mutex_unlock(&running_lock);
+}
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pulse/pulseaudio.h>
+
+#include "log.h"
+#include "bluepulse.h"
+
+/* Records what the server tells us, with timestamps, so tools/replay
+ * can feed the same sequence through the daemon again offline.
+ *
+ * After a header of TRACE_MAGIC and the number of servers, each record
+ * is the usec since the previous one, a byte of type | server << 4 and
+ * the type's fields. Numbers are LEB128 varints and strings a varint of
+ * their length + 1 (0 for NULL) followed by the bytes:
+ *
+ *   TRACE_EVENT   type, index
+ *   TRACE_SOURCE  eol byte (0, 1 or -1), then unless eol: index, format
+ *                 byte, rate, channels byte, state byte, name,
+ *                 description, bluetooth.protocol, bluetooth.codec,
+ *                 device.string
+ *   TRACE_SINK    eol byte, then unless eol: format byte, rate,
+ *                 channels byte
+ *   TRACE_READ    source index, length
+ *   TRACE_STREAM  stream serial, state byte (READY or FAILED)
+ *   TRACE_STARTED stream serial
+ *   TRACE_UNDERFLOW stream serial
+ *   TRACE_CLIENT  eol byte, then unless eol: index, application.name,
+ *                 application.process.id, byte set if it was us
+ *   TRACE_MODULE  eol byte, then unless eol: index, name, argument
+ *
+ * Streams are numbered in the order they were created, from 0. Audio is
+ * not recorded, only how much of it arrived when. */
+
+/* Keeps the occasional write out of the way of most callbacks */
+#define TRACE_BUFFER (1024 * 1024)
+
+static FILE *trace;
+static pa_usec_t last_usec;
+
+static void put_byte(uint8_t b)
+{
+    putc_unlocked(b, trace);
+}
+
+static void put_varint(uint64_t v)
+{
+    while (v >= 0x80) {
+        put_byte(v | 0x80);
+        v >>= 7;
+    }
+    put_byte(v);
+}
+
+static void put_string(const char *s)
+{
+    size_t len;
+
+    if (s == NULL) {
+        put_varint(0);
+        return;
+    }
+
+    len = strlen(s);
+    put_varint(len + 1);
+    fwrite(s, 1, len, trace);
+}
+
+static void put_header(enum trace_type type, unsigned int server)
+{
+    pa_usec_t now = pa_rtclock_now();
+
+    put_varint(now - last_usec);
+    put_byte(type | server << 4);
+    last_usec = now;
+}
+
+int trace_open(const char *path, unsigned int servers)
+{
+    trace = fopen(path, "w");
+    if (trace == NULL) {
+        g_critical("Can't write trace %s: %m", path);
+        return 1;
+    }
+
+    setvbuf(trace, NULL, _IOFBF, TRACE_BUFFER);
+    put_varint(TRACE_MAGIC);
+    put_varint(servers);
+    last_usec = pa_rtclock_now();
+    return 0;
+}
+
+void trace_close()
+{
+    if (trace == NULL)
+        return;
+
+    fclose(trace);
+    trace = NULL;
+}
+
+void trace_event(unsigned int server, uint32_t type, uint32_t idx)
+{
+    if (trace == NULL)
+        return;
+
+    put_header(TRACE_EVENT, server);
+    put_varint(type);
+    put_varint(idx);
+}
+
+void trace_source(unsigned int server, const pa_source_info *i, int eol)
+{
+    if (trace == NULL)
+        return;
+
+    put_header(TRACE_SOURCE, server);
+    put_byte(eol);
+    if (eol)
+        return;
+
+    put_varint(i->index);
+    put_byte(i->sample_spec.format);
+    put_varint(i->sample_spec.rate);
+    put_byte(i->sample_spec.channels);
+    put_byte(i->state);
+    put_string(i->name);
+    put_string(i->description);
+    put_string(pa_proplist_gets(i->proplist, "bluetooth.protocol"));
+    put_string(pa_proplist_gets(i->proplist, "bluetooth.codec"));
+    put_string(pa_proplist_gets(i->proplist, PA_PROP_DEVICE_STRING));
+}
+
+void trace_sink(unsigned int server, const pa_sink_info *i, int eol)
+{
+    if (trace == NULL)
+        return;
+
+    put_header(TRACE_SINK, server);
+    put_byte(eol);
+    if (eol)
+        return;
+
+    put_byte(i->sample_spec.format);
+    put_varint(i->sample_spec.rate);
+    put_byte(i->sample_spec.channels);
+}
+
+void trace_read(unsigned int server, uint32_t source_idx, size_t len)
+{
+    if (trace == NULL)
+        return;
+
+    put_header(TRACE_READ, server);
+    put_varint(source_idx);
+    put_varint(len);
+}
+
+void trace_stream(unsigned int server, uint32_t serial,
+        pa_stream_state_t state)
+{
+    /* the others follow from our own connects and disconnects */
+    if (trace == NULL || (state != PA_STREAM_READY &&
+                state != PA_STREAM_FAILED))
+        return;
+
+    put_header(TRACE_STREAM, server);
+    put_varint(serial);
+    put_byte(state);
+}
+
+void trace_started(unsigned int server, uint32_t serial)
+{
+    if (trace == NULL)
+        return;
+
+    put_header(TRACE_STARTED, server);
+    put_varint(serial);
+}
+
+void trace_underflow(unsigned int server, uint32_t serial)
+{
+    if (trace == NULL)
+        return;
+
+    put_header(TRACE_UNDERFLOW, server);
+    put_varint(serial);
+}
+
+void trace_client(unsigned int server, const pa_client_info *i, int eol)
+{
+    const char *pid;
+
+    if (trace == NULL)
+        return;
+
+    put_header(TRACE_CLIENT, server);
+    put_byte(eol);
+    if (eol)
+        return;
+
+    /* the replay has a pid of its own to put in for ours */
+    pid = pa_proplist_gets(i->proplist, PA_PROP_APPLICATION_PROCESS_ID);
+    put_varint(i->index);
+    put_string(pa_proplist_gets(i->proplist, PA_PROP_APPLICATION_NAME));
+    put_string(pid);
+    put_byte(pid && atoi(pid) == getpid());
+}
+
+void trace_module(unsigned int server, const pa_module_info *i, int eol)
+{
+    if (trace == NULL)
+        return;
+
+    put_header(TRACE_MODULE, server);
+    put_byte(eol);
+    if (eol)
+        return;
+
+    put_varint(i->index);
+    put_string(i->name);
+    put_string(i->argument);
+}
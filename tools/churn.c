@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pulse/pulseaudio.h>
+
+#include "src/bluepulse.h"
+#include "src/log.h"
+
+#define pao(o) pa_operation_unref(o)
+
+/* Connects and disconnects fake A2DP sources as fast as bluepulse keeps
+ * up: each slot loads a null source tagged as a Bluetooth source, waits
+ * for bluepulse to start playing it, optionally kills one of its
+ * streams, and unloads the source again. Reports cycles per second,
+ * setup and teardown latency and the RSS of a given bluepulse process,
+ * for soaks of many hours. */
+
+#define SLOT_TIMEOUT_MSEC 5000
+#define HIST_USEC 100           /* histogram resolution */
+#define HIST_BUCKETS 100000     /* up to 10 s */
+
+enum slot_state {
+    SLOT_IDLE,
+    SLOT_LOADING,       /* waiting for the null source */
+    SLOT_WAITING,       /* waiting for bluepulse to play it */
+    SLOT_HOLDING,       /* playing for --hold msec */
+    SLOT_KILLED,        /* a stream was killed, waiting for teardown */
+    SLOT_UNLOADING,     /* source removed, waiting for teardown */
+};
+
+struct slot {
+    unsigned int id;
+    unsigned int gen;
+    enum slot_state state;
+    uint32_t module;
+    uint32_t sink_input;
+    uint32_t source_output;
+    pa_usec_t since;
+    pa_time_event *timer;
+};
+
+struct histogram {
+    unsigned int buckets[HIST_BUCKETS];
+    unsigned long count;
+    pa_usec_t max;
+};
+
+static pa_mainloop *mainloop;
+static pa_mainloop_api *api;
+static pa_context *context;
+static struct slot *slots;
+
+static unsigned int n_slots = 4;
+static unsigned long max_cycles = 1000;
+static unsigned int duration_sec;
+static unsigned int hold_msec;
+static unsigned int kill_every = 10;
+static unsigned int report_sec = 60;
+static unsigned long leak_kb = 1024;
+static pid_t pid;
+
+static int stopping;
+static pa_usec_t start_usec;
+static unsigned long started, held, cycles, kills, timeouts, stuck, errors;
+static struct histogram setup, teardown, failure;
+static long rss_base = -1, rss_last = -1, rss_max;
+
+static void slot_start(struct slot *s);
+static void slot_unload(struct slot *s);
+
+static void hist_add(struct histogram *h, pa_usec_t usec)
+{
+    unsigned int i = usec / HIST_USEC;
+
+    h->buckets[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1]++;
+    h->count++;
+    if (usec > h->max)
+        h->max = usec;
+}
+
+static double hist_msec(const struct histogram *h, double q)
+{
+    unsigned long n = 0, want = q * h->count;
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        n += h->buckets[i];
+        if (n > want)
+            break;
+    }
+    return (i + 1) * HIST_USEC / 1000.0;
+}
+
+static void hist_print(const char *name, const struct histogram *h)
+{
+    if (!h->count)
+        return;
+
+    printf("  %-9s %8lu   p50 %7.1f   p99 %7.1f   p99.9 %7.1f   "
+            "max %7.1f ms\n", name, h->count, hist_msec(h, 0.5),
+            hist_msec(h, 0.99), hist_msec(h, 0.999), h->max / 1000.0);
+}
+
+/* VmRSS in kB, -1 once the process is gone */
+static long rss_kb(void)
+{
+    char path[64], line[128];
+    long kb = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+
+    return kb;
+}
+
+static void report(void)
+{
+    double elapsed = (pa_rtclock_now() - start_usec) / (double)PA_USEC_PER_SEC;
+
+    printf("%.0f s: %lu cycles, %.1f source events/s, %lu killed, "
+            "%lu timeouts, %lu stuck, %lu errors\n", elapsed, cycles,
+            elapsed > 0 ? 2 * cycles / elapsed : 0.0, kills, timeouts,
+            stuck, errors);
+    hist_print("setup", &setup);
+    hist_print("teardown", &teardown);
+    hist_print("failure", &failure);
+
+    if (pid) {
+        rss_last = rss_kb();
+        if (rss_last < 0) {
+            printf("  bluepulse (pid %d) is gone\n", (int)pid);
+        } else {
+            /* the first sample is taken after a round of warmup */
+            if (rss_base < 0)
+                rss_base = rss_last;
+            if (rss_last > rss_max)
+                rss_max = rss_last;
+            printf("  rss %ld kB, %+ld kB since first report, max %ld kB\n",
+                    rss_last, rss_last - rss_base, rss_max);
+        }
+    }
+    fflush(stdout);
+}
+
+static void done(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < n_slots; i++) {
+        if (slots[i].state != SLOT_IDLE)
+            return;
+    }
+
+    report();
+    pa_context_disconnect(context);
+    api->quit(api, 0);
+}
+
+static void stop(void)
+{
+    unsigned int i;
+
+    if (stopping)
+        return;
+    stopping = 1;
+
+    /* slots still waiting for bluepulse won't see it anymore */
+    for (i = 0; i < n_slots; i++) {
+        if (slots[i].state == SLOT_WAITING || slots[i].state == SLOT_HOLDING)
+            slot_unload(&slots[i]);
+    }
+    done();
+}
+
+static void slot_timer(struct slot *s, pa_time_event_cb_t cb,
+        unsigned int msec)
+{
+    pa_usec_t when = pa_rtclock_now() + msec * PA_USEC_PER_MSEC;
+
+    if (s->timer)
+        api->time_restart(s->timer, pa_timeval_rtstore(
+                    &(struct timeval){0}, when, 0));
+    else
+        s->timer = pa_context_rttime_new(context, when, cb, s);
+}
+
+static void slot_timer_stop(struct slot *s)
+{
+    if (s->timer) {
+        api->time_free(s->timer);
+        s->timer = NULL;
+    }
+}
+
+static void slot_done(struct slot *s)
+{
+    slot_timer_stop(s);
+    s->state = SLOT_IDLE;
+    s->module = PA_INVALID_INDEX;
+    s->sink_input = PA_INVALID_INDEX;
+    s->source_output = PA_INVALID_INDEX;
+    cycles++;
+
+    if (duration_sec && pa_rtclock_now() - start_usec >=
+            duration_sec * PA_USEC_PER_SEC)
+        stop();
+    if (!duration_sec && started >= max_cycles)
+        stop();
+
+    if (stopping)
+        done();
+    else
+        slot_start(s);
+}
+
+static void slot_unloaded(pa_context *c, int success, void *data)
+{
+    struct slot *s = (struct slot*)data;
+
+    if (!success)
+        errors++;
+
+    /* bluepulse never played it, there is nothing to tear down */
+    if (s->state == SLOT_UNLOADING && s->sink_input == PA_INVALID_INDEX)
+        slot_done(s);
+}
+
+static void slot_timeout(pa_mainloop_api *a, pa_time_event *e,
+        const struct timeval *tv, void *data)
+{
+    struct slot *s = (struct slot*)data;
+
+    api->time_free(s->timer);
+    s->timer = NULL;
+
+    switch (s->state) {
+        case SLOT_WAITING:
+            timeouts++;
+            slot_unload(s);
+            break;
+
+        case SLOT_HOLDING:
+            if (kill_every && ++held % kill_every == 0) {
+                /* alternate between the record and the playback side */
+                s->state = SLOT_KILLED;
+                s->since = pa_rtclock_now();
+                slot_timer(s, slot_timeout, SLOT_TIMEOUT_MSEC);
+                kills++;
+                if (kills % 2 && s->source_output != PA_INVALID_INDEX)
+                    pao(pa_context_kill_source_output(context,
+                                s->source_output, NULL, NULL));
+                else
+                    pao(pa_context_kill_sink_input(context,
+                                s->sink_input, NULL, NULL));
+            } else {
+                slot_unload(s);
+            }
+            break;
+
+        case SLOT_KILLED:
+        case SLOT_UNLOADING:
+            /* bluepulse kept a stream of a source that is gone */
+            stuck++;
+            g_warning("Slot %u: %s not torn down after %u ms", s->id,
+                    s->state == SLOT_KILLED ? "killed loopback" : "loopback",
+                    SLOT_TIMEOUT_MSEC);
+            if (s->state == SLOT_KILLED)
+                slot_unload(s);
+            else
+                slot_done(s);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void slot_unload(struct slot *s)
+{
+    s->state = SLOT_UNLOADING;
+    s->since = pa_rtclock_now();
+    slot_timer(s, slot_timeout, SLOT_TIMEOUT_MSEC);
+    pao(pa_context_unload_module(context, s->module, slot_unloaded, s));
+}
+
+static void slot_loaded(pa_context *c, uint32_t idx, void *data)
+{
+    struct slot *s = (struct slot*)data;
+
+    if (idx == PA_INVALID_INDEX) {
+        g_warning("Loading a null source failed: %s",
+                pa_strerror(pa_context_errno(c)));
+        errors++;
+        s->state = SLOT_IDLE;
+        stop();
+        return;
+    }
+
+    /* bluepulse may have been quicker than the reply */
+    s->module = idx;
+    if (s->state != SLOT_LOADING)
+        return;
+
+    s->state = SLOT_WAITING;
+    if (stopping)
+        slot_unload(s);
+}
+
+static void slot_start(struct slot *s)
+{
+    char args[256];
+
+    s->gen++;
+    started++;
+    snprintf(args, sizeof(args), "source_name=churn_%u_%u "
+            "source_properties=\"bluetooth.protocol=a2dp_source "
+            "device.description=churn-%u-%u\"", s->id, s->gen, s->id, s->gen);
+
+    s->state = SLOT_LOADING;
+    s->since = pa_rtclock_now();
+    slot_timer(s, slot_timeout, SLOT_TIMEOUT_MSEC);
+    pao(pa_context_load_module(context, "module-null-source", args,
+                slot_loaded, s));
+}
+
+/* Streams are named after the source description, churn-SLOT-GEN */
+static struct slot* slot_by_name(const char *name)
+{
+    unsigned int id, gen;
+
+    if (name == NULL || sscanf(name, "churn-%u-%u", &id, &gen) != 2 ||
+            id >= n_slots || slots[id].gen != gen)
+        return NULL;
+
+    return &slots[id];
+}
+
+static void sink_input_info(pa_context *c, const pa_sink_input_info *i,
+        int eol, void *data)
+{
+    struct slot *s;
+
+    if (eol || (s = slot_by_name(i->name)) == NULL)
+        return;
+    if (s->state != SLOT_WAITING && s->state != SLOT_LOADING)
+        return;
+
+    /* with several sinks only the first stream is tracked */
+    s->sink_input = i->index;
+    hist_add(&setup, pa_rtclock_now() - s->since);
+    s->state = SLOT_HOLDING;
+    slot_timer(s, slot_timeout, hold_msec);
+}
+
+static void source_output_info(pa_context *c, const pa_source_output_info *i,
+        int eol, void *data)
+{
+    struct slot *s;
+
+    if (!eol && (s = slot_by_name(i->name)) != NULL)
+        s->source_output = i->index;
+}
+
+static void sink_input_removed(uint32_t idx)
+{
+    unsigned int i;
+
+    for (i = 0; i < n_slots; i++) {
+        struct slot *s = &slots[i];
+
+        if (s->sink_input != idx)
+            continue;
+
+        switch (s->state) {
+            case SLOT_KILLED:
+                hist_add(&failure, pa_rtclock_now() - s->since);
+                s->sink_input = PA_INVALID_INDEX;
+                slot_unload(s);
+                break;
+
+            case SLOT_UNLOADING:
+                hist_add(&teardown, pa_rtclock_now() - s->since);
+                slot_done(s);
+                break;
+
+            default:
+                /* bluepulse dropped it on its own */
+                s->sink_input = PA_INVALID_INDEX;
+                break;
+        }
+    }
+}
+
+static void subscribed(pa_context *c, pa_subscription_event_type_t t,
+        uint32_t idx, void *data)
+{
+    int facility = t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
+    int type = t & PA_SUBSCRIPTION_EVENT_TYPE_MASK;
+
+    if (facility == PA_SUBSCRIPTION_EVENT_SINK_INPUT) {
+        if (type == PA_SUBSCRIPTION_EVENT_NEW)
+            pao(pa_context_get_sink_input_info(c, idx, sink_input_info, NULL));
+        else if (type == PA_SUBSCRIPTION_EVENT_REMOVE)
+            sink_input_removed(idx);
+    } else if (facility == PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT &&
+            type == PA_SUBSCRIPTION_EVENT_NEW) {
+        pao(pa_context_get_source_output_info(c, idx,
+                    source_output_info, NULL));
+    }
+}
+
+static void report_timer(pa_mainloop_api *a, pa_time_event *e,
+        const struct timeval *tv, void *data)
+{
+    report();
+    if (pid && rss_last < 0) {
+        stop();
+        return;
+    }
+    api->time_restart(e, pa_timeval_rtstore(&(struct timeval){0},
+                pa_rtclock_now() + report_sec * PA_USEC_PER_SEC, 0));
+}
+
+static void context_state(pa_context *c, void *data)
+{
+    unsigned int i;
+
+    switch (pa_context_get_state(c)) {
+        case PA_CONTEXT_READY:
+            pa_context_set_subscribe_callback(c, subscribed, NULL);
+            pao(pa_context_subscribe(c, PA_SUBSCRIPTION_MASK_SINK_INPUT |
+                        PA_SUBSCRIPTION_MASK_SOURCE_OUTPUT, NULL, NULL));
+
+            start_usec = pa_rtclock_now();
+            pa_context_rttime_new(c, start_usec +
+                    report_sec * PA_USEC_PER_SEC, report_timer, NULL);
+            for (i = 0; i < n_slots; i++)
+                slot_start(&slots[i]);
+            break;
+
+        case PA_CONTEXT_FAILED:
+            g_critical("Connection failed: %s",
+                    pa_strerror(pa_context_errno(c)));
+            api->quit(api, 1);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void signal_stop(pa_mainloop_api *a, pa_signal_event *e,
+        int sig, void *data)
+{
+    stop();
+}
+
+static void usage(FILE *f)
+{
+    fprintf(f, "Usage: churn [OPTIONS]\n"
+            "  -n, --cycles=N       connect and disconnect N sources (1000)\n"
+            "  -t, --time=SEC       run for SEC seconds instead\n"
+            "  -j, --slots=N        keep up to N sources in flight (4)\n"
+            "  -H, --hold=MSEC      play each source for MSEC first (0)\n"
+            "  -k, --kill=N         kill a stream every Nth cycle, 0 never (10)\n"
+            "  -p, --pid=PID        sample the RSS of bluepulse PID\n"
+            "  -i, --interval=SEC   report every SEC seconds (60)\n"
+            "  -L, --leak=KB        fail if RSS grew more than KB (1024)\n"
+            "  -s, --server=SERVER  PulseAudio server to use\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        {"cycles", required_argument, NULL, 'n'},
+        {"time", required_argument, NULL, 't'},
+        {"slots", required_argument, NULL, 'j'},
+        {"hold", required_argument, NULL, 'H'},
+        {"kill", required_argument, NULL, 'k'},
+        {"pid", required_argument, NULL, 'p'},
+        {"interval", required_argument, NULL, 'i'},
+        {"leak", required_argument, NULL, 'L'},
+        {"server", required_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *server = NULL;
+    int c, ret = 1;
+    unsigned int i;
+
+    while ((c = getopt_long(argc, argv, "n:t:j:H:k:p:i:L:s:h",
+                    options, NULL)) != -1) {
+        switch (c) {
+            case 'n': max_cycles = strtoul(optarg, NULL, 10); break;
+            case 't': duration_sec = strtoul(optarg, NULL, 10); break;
+            case 'j': n_slots = strtoul(optarg, NULL, 10); break;
+            case 'H': hold_msec = strtoul(optarg, NULL, 10); break;
+            case 'k': kill_every = strtoul(optarg, NULL, 10); break;
+            case 'p': pid = strtol(optarg, NULL, 10); break;
+            case 'i': report_sec = strtoul(optarg, NULL, 10); break;
+            case 'L': leak_kb = strtoul(optarg, NULL, 10); break;
+            case 's': server = optarg; break;
+            case 'h':
+                usage(stdout);
+                return 0;
+            default:
+                usage(stderr);
+                return 1;
+        }
+    }
+
+    if (!n_slots || !report_sec || (!max_cycles && !duration_sec)) {
+        usage(stderr);
+        return 1;
+    }
+
+    slots = calloc(n_slots, sizeof(*slots));
+    for (i = 0; i < n_slots; i++) {
+        slots[i].id = i;
+        slots[i].module = PA_INVALID_INDEX;
+        slots[i].sink_input = PA_INVALID_INDEX;
+        slots[i].source_output = PA_INVALID_INDEX;
+    }
+
+    mainloop = pa_mainloop_new();
+    api = pa_mainloop_get_api(mainloop);
+    pa_signal_init(api);
+    pa_signal_new(SIGINT, signal_stop, NULL);
+    pa_signal_new(SIGTERM, signal_stop, NULL);
+
+    context = pa_context_new(api, "bluepulse churn");
+    pa_context_set_state_callback(context, context_state, NULL);
+    pa_context_connect(context, server, PA_CONTEXT_NOFLAGS, NULL);
+
+    pa_mainloop_run(mainloop, &ret);
+
+    /* a sanitizer build aborts on a double free */
+    if (pid && rss_last < 0) {
+        fprintf(stderr, "bluepulse died during the run\n");
+        ret = 2;
+    } else if (pid && rss_last - rss_base > (long)leak_kb) {
+        fprintf(stderr, "RSS grew by %ld kB, possible leak\n",
+                rss_last - rss_base);
+        ret = 3;
+    } else if (stuck || errors) {
+        ret = 1;
+    }
+
+    pa_context_unref(context);
+    pa_signal_done();
+    pa_mainloop_free(mainloop);
+    free(slots);
+
+    return ret;
+}
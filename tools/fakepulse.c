@@ -0,0 +1,930 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pulse/pulseaudio.h>
+#include <ccan/list/list.h>
+
+#include "src/log.h"
+#include "src/bluepulse.h"
+#include "tools/fakepulse.h"
+
+/* Just enough of libpulse's context and stream API for the daemon to
+ * run without a server, on a virtual clock. Replies to introspection
+ * requests are queued until the replay hands over the recorded ones;
+ * streams become ready on the next dispatch and record streams deliver
+ * whatever the replay says arrived. After fake_traced() stream states,
+ * started and underflow callbacks and the client and module lists come
+ * from the trace too. Everything else is accepted and forgotten. The
+ * rest of libpulse (proplists, sample specs) is the real thing. */
+
+enum pending_kind {
+    PENDING_SOURCE,         /* by index */
+    PENDING_SOURCE_LIST,
+    PENDING_SINK,
+    PENDING_CLIENT_LIST,
+    PENDING_MODULE_LIST,
+};
+
+struct pending {
+    pa_context *context;
+    enum pending_kind kind;
+    uint32_t idx;
+    union {
+        pa_source_info_cb_t source;
+        pa_sink_info_cb_t sink;
+        pa_client_info_cb_t client;
+        pa_module_info_cb_t module;
+    } cb;
+    void *data;
+    struct list_node list;
+};
+
+struct pa_context {
+    unsigned int refs;
+    unsigned int id;
+    pa_context_state_t state;
+    pa_context_notify_cb_t state_cb;
+    void *state_data;
+    pa_context_subscribe_cb_t subscribe_cb;
+    void *subscribe_data;
+    pa_subscription_mask_t mask;
+};
+
+struct pa_stream {
+    unsigned int refs;
+    pa_context *context;
+    uint32_t serial;
+    pa_stream_state_t state;
+    pa_sample_spec spec;
+    pa_buffer_attr attr;
+    pa_timing_info timing;
+    char *device;
+    uint32_t device_idx;
+    int record;
+    pa_stream_notify_cb_t state_cb;
+    void *state_data;
+    pa_stream_request_cb_t read_cb;
+    void *read_data;
+    pa_stream_notify_cb_t started_cb;
+    void *started_data;
+    pa_stream_notify_cb_t underflow_cb;
+    void *underflow_data;
+    int started;
+    size_t readable;
+    struct list_node list;
+};
+
+struct pa_operation {
+    int unused;
+};
+
+struct pa_time_event {
+    pa_usec_t when;
+    pa_time_event_cb_t cb;
+    void *data;
+    int dead;
+    struct list_node list;
+};
+
+/* Work left for the next dispatch, like a server reply would be */
+struct deferred {
+    void (*cb)(void *data);
+    void *data;
+    struct list_node list;
+};
+
+/* Source names the replay has seen, for record streams that connect
+ * by name */
+struct source_name {
+    unsigned int server;
+    uint32_t idx;
+    char *name;
+    struct list_node list;
+};
+
+static pa_usec_t now_usec;
+static pa_operation operation;
+static pa_context *contexts[MAX_SERVERS];
+static unsigned int n_contexts;
+static LIST_HEAD(pendings);
+static LIST_HEAD(streams);
+static LIST_HEAD(timers);
+static LIST_HEAD(deferreds);
+static LIST_HEAD(source_names);
+static uint8_t *silence;
+static size_t silence_size;
+static int quit_requested;
+/* stream callbacks and client and module lists are in the trace */
+static int traced;
+static uint32_t next_serial;
+
+struct fake_stats fake_stats;
+
+static void defer(void (*cb)(void *data), void *data)
+{
+    struct deferred *d = calloc(1, sizeof(*d));
+
+    d->cb = cb;
+    d->data = data;
+    list_add_tail(&deferreds, &d->list);
+}
+
+pa_usec_t pa_rtclock_now(void)
+{
+    return now_usec;
+}
+
+void pa_operation_unref(pa_operation *o)
+{
+}
+
+/* Timers */
+
+static pa_time_event* timer_new(pa_usec_t when, pa_time_event_cb_t cb,
+        void *data)
+{
+    pa_time_event *e = calloc(1, sizeof(*e));
+
+    e->when = when;
+    e->cb = cb;
+    e->data = data;
+    list_add_tail(&timers, &e->list);
+    return e;
+}
+
+static pa_time_event* api_time_new(pa_mainloop_api *a,
+        const struct timeval *tv, pa_time_event_cb_t cb, void *data)
+{
+    /* only reconnects use wall clock timers, a second is close enough */
+    return timer_new(now_usec + PA_USEC_PER_SEC, cb, data);
+}
+
+static void api_time_restart(pa_time_event *e, const struct timeval *tv)
+{
+    e->when = now_usec + PA_USEC_PER_SEC;
+}
+
+static void api_time_free(pa_time_event *e)
+{
+    e->dead = 1;
+}
+
+static void api_quit(pa_mainloop_api *a, int retval)
+{
+    quit_requested = 1;
+}
+
+pa_mainloop_api fake_api = {
+    .time_new = api_time_new,
+    .time_restart = api_time_restart,
+    .time_free = api_time_free,
+    .quit = api_quit,
+};
+
+pa_time_event* pa_context_rttime_new(const pa_context *c, pa_usec_t usec,
+        pa_time_event_cb_t cb, void *userdata)
+{
+    return timer_new(usec, cb, userdata);
+}
+
+void pa_context_rttime_restart(const pa_context *c, pa_time_event *e,
+        pa_usec_t usec)
+{
+    e->when = usec;
+}
+
+/* Contexts */
+
+pa_context* pa_context_new(pa_mainloop_api *api, const char *name)
+{
+    pa_context *c;
+
+    g_assert(n_contexts < MAX_SERVERS);
+    c = calloc(1, sizeof(*c));
+    c->refs = 1;
+    c->id = n_contexts;
+    c->state = PA_CONTEXT_UNCONNECTED;
+    contexts[n_contexts++] = c;
+    return c;
+}
+
+void pa_context_unref(pa_context *c)
+{
+    /* kept for the replay to look up, freed with fake_free() */
+    c->refs--;
+}
+
+static void context_ready(void *data)
+{
+    pa_context *c = (pa_context*)data;
+
+    if (c->state != PA_CONTEXT_CONNECTING)
+        return;
+    c->state = PA_CONTEXT_READY;
+    if (c->state_cb)
+        c->state_cb(c, c->state_data);
+}
+
+int pa_context_connect(pa_context *c, const char *server,
+        pa_context_flags_t flags, const pa_spawn_api *api)
+{
+    c->state = PA_CONTEXT_CONNECTING;
+    defer(context_ready, c);
+    return 0;
+}
+
+void pa_context_disconnect(pa_context *c)
+{
+    c->state = PA_CONTEXT_TERMINATED;
+}
+
+pa_context_state_t pa_context_get_state(const pa_context *c)
+{
+    return c->state;
+}
+
+int pa_context_errno(const pa_context *c)
+{
+    return PA_OK;
+}
+
+void pa_context_set_state_callback(pa_context *c,
+        pa_context_notify_cb_t cb, void *userdata)
+{
+    c->state_cb = cb;
+    c->state_data = userdata;
+}
+
+void pa_context_set_subscribe_callback(pa_context *c,
+        pa_context_subscribe_cb_t cb, void *userdata)
+{
+    c->subscribe_cb = cb;
+    c->subscribe_data = userdata;
+}
+
+pa_operation* pa_context_subscribe(pa_context *c, pa_subscription_mask_t m,
+        pa_context_success_cb_t cb, void *userdata)
+{
+    c->mask = m;
+    return &operation;
+}
+
+static pa_operation* pending_add(pa_context *c, enum pending_kind kind,
+        uint32_t idx, void *cb, void *data)
+{
+    struct pending *p = calloc(1, sizeof(*p));
+
+    p->context = c;
+    p->kind = kind;
+    p->idx = idx;
+    p->data = data;
+    switch (kind) {
+        case PENDING_SOURCE:
+        case PENDING_SOURCE_LIST:
+            p->cb.source = (pa_source_info_cb_t)cb;
+            break;
+        case PENDING_SINK:
+            p->cb.sink = (pa_sink_info_cb_t)cb;
+            break;
+        case PENDING_CLIENT_LIST:
+            p->cb.client = (pa_client_info_cb_t)cb;
+            break;
+        case PENDING_MODULE_LIST:
+            p->cb.module = (pa_module_info_cb_t)cb;
+            break;
+    }
+    list_add_tail(&pendings, &p->list);
+    return &operation;
+}
+
+pa_operation* pa_context_get_source_info_by_index(pa_context *c,
+        uint32_t idx, pa_source_info_cb_t cb, void *userdata)
+{
+    return pending_add(c, PENDING_SOURCE, idx, cb, userdata);
+}
+
+pa_operation* pa_context_get_source_info_list(pa_context *c,
+        pa_source_info_cb_t cb, void *userdata)
+{
+    return pending_add(c, PENDING_SOURCE_LIST, PA_INVALID_INDEX,
+            cb, userdata);
+}
+
+pa_operation* pa_context_get_sink_info_by_name(pa_context *c,
+        const char *name, pa_sink_info_cb_t cb, void *userdata)
+{
+    return pending_add(c, PENDING_SINK, PA_INVALID_INDEX, cb, userdata);
+}
+
+/* Without a trace of them, nobody else is connected and no modules
+ * are loaded */
+struct empty_list {
+    pa_context *context;
+    void (*cb)(pa_context *c, const void *i, int eol, void *data);
+    void *data;
+};
+
+static void empty_list_end(void *data)
+{
+    struct empty_list *e = (struct empty_list*)data;
+
+    e->cb(e->context, NULL, 1, e->data);
+    free(e);
+}
+
+static pa_operation* empty_list(pa_context *c, void *cb, void *data)
+{
+    struct empty_list *e = calloc(1, sizeof(*e));
+
+    e->context = c;
+    e->cb = (void (*)(pa_context*, const void*, int, void*))cb;
+    e->data = data;
+    defer(empty_list_end, e);
+    return &operation;
+}
+
+pa_operation* pa_context_get_client_info_list(pa_context *c,
+        pa_client_info_cb_t cb, void *userdata)
+{
+    if (traced)
+        return pending_add(c, PENDING_CLIENT_LIST, PA_INVALID_INDEX,
+                cb, userdata);
+    return empty_list(c, cb, userdata);
+}
+
+pa_operation* pa_context_get_module_info_list(pa_context *c,
+        pa_module_info_cb_t cb, void *userdata)
+{
+    if (traced)
+        return pending_add(c, PENDING_MODULE_LIST, PA_INVALID_INDEX,
+                cb, userdata);
+    return empty_list(c, cb, userdata);
+}
+
+pa_operation* pa_context_set_source_mute_by_index(pa_context *c,
+        uint32_t idx, int mute, pa_context_success_cb_t cb, void *userdata)
+{
+    return &operation;
+}
+
+pa_operation* pa_context_set_sink_input_volume(pa_context *c, uint32_t idx,
+        const pa_cvolume *volume, pa_context_success_cb_t cb, void *userdata)
+{
+    if (cb)
+        cb(c, 1, userdata);
+    return &operation;
+}
+
+pa_operation* pa_context_load_module(pa_context *c, const char *name,
+        const char *argument, pa_context_index_cb_t cb, void *userdata)
+{
+    static uint32_t next_module;
+
+    if (cb)
+        cb(c, next_module++, userdata);
+    return &operation;
+}
+
+pa_operation* pa_context_unload_module(pa_context *c, uint32_t idx,
+        pa_context_success_cb_t cb, void *userdata)
+{
+    if (cb)
+        cb(c, 1, userdata);
+    return &operation;
+}
+
+/* Streams */
+
+pa_stream* pa_stream_new(pa_context *c, const char *name,
+        const pa_sample_spec *ss, const pa_channel_map *map)
+{
+    pa_stream *s = calloc(1, sizeof(*s));
+
+    s->refs = 1;
+    s->context = c;
+    /* numbered like the daemon numbers them for the trace */
+    s->serial = next_serial++;
+    s->state = PA_STREAM_UNCONNECTED;
+    s->spec = *ss;
+    s->device_idx = PA_INVALID_INDEX;
+    list_add_tail(&streams, &s->list);
+    return s;
+}
+
+pa_stream* pa_stream_ref(pa_stream *s)
+{
+    s->refs++;
+    return s;
+}
+
+void pa_stream_unref(pa_stream *s)
+{
+    if (--s->refs)
+        return;
+
+    list_del(&s->list);
+    free(s->device);
+    free(s);
+}
+
+static void stream_ready(void *data)
+{
+    pa_stream *s = (pa_stream*)data;
+
+    if (s->state == PA_STREAM_CREATING) {
+        s->state = PA_STREAM_READY;
+        if (s->state_cb)
+            s->state_cb(s, s->state_data);
+    }
+    pa_stream_unref(s);
+}
+
+static void stream_connect(pa_stream *s, const char *dev,
+        const pa_buffer_attr *attr)
+{
+    struct source_name *n;
+
+    s->device = strdup(dev ? dev : "replay");
+    if (attr)
+        s->attr = *attr;
+    else
+        s->attr = (pa_buffer_attr){-1, -1, -1, -1, -1};
+
+    list_for_each(&source_names, n, list) {
+        if (s->record && n->server == s->context->id &&
+                !strcmp(n->name, s->device))
+            s->device_idx = n->idx;
+    }
+
+    s->state = PA_STREAM_CREATING;
+    if (!traced)
+        defer(stream_ready, pa_stream_ref(s));
+}
+
+int pa_stream_connect_record(pa_stream *s, const char *dev,
+        const pa_buffer_attr *attr, pa_stream_flags_t flags)
+{
+    s->record = 1;
+    stream_connect(s, dev, attr);
+    return 0;
+}
+
+int pa_stream_connect_playback(pa_stream *s, const char *dev,
+        const pa_buffer_attr *attr, pa_stream_flags_t flags,
+        const pa_cvolume *volume, pa_stream *sync_stream)
+{
+    stream_connect(s, dev, attr);
+    return 0;
+}
+
+int pa_stream_disconnect(pa_stream *s)
+{
+    s->state = PA_STREAM_TERMINATED;
+    return 0;
+}
+
+pa_stream_state_t pa_stream_get_state(const pa_stream *s)
+{
+    return s->state;
+}
+
+void pa_stream_set_state_callback(pa_stream *s, pa_stream_notify_cb_t cb,
+        void *userdata)
+{
+    s->state_cb = cb;
+    s->state_data = userdata;
+}
+
+void pa_stream_set_read_callback(pa_stream *s, pa_stream_request_cb_t cb,
+        void *userdata)
+{
+    s->read_cb = cb;
+    s->read_data = userdata;
+}
+
+void pa_stream_set_started_callback(pa_stream *s, pa_stream_notify_cb_t cb,
+        void *userdata)
+{
+    s->started_cb = cb;
+    s->started_data = userdata;
+}
+
+void pa_stream_set_underflow_callback(pa_stream *s, pa_stream_notify_cb_t cb,
+        void *userdata)
+{
+    s->underflow_cb = cb;
+    s->underflow_data = userdata;
+}
+
+int pa_stream_peek(pa_stream *s, const void **data, size_t *nbytes)
+{
+    *data = s->readable ? silence : NULL;
+    *nbytes = s->readable;
+    return 0;
+}
+
+int pa_stream_drop(pa_stream *s)
+{
+    s->readable = 0;
+    return 0;
+}
+
+size_t pa_stream_readable_size(const pa_stream *s)
+{
+    return s->readable;
+}
+
+size_t pa_stream_writable_size(const pa_stream *s)
+{
+    return s->attr.tlength != (uint32_t)-1 ? s->attr.tlength : 65536;
+}
+
+int pa_stream_write_ext_free(pa_stream *s, const void *data, size_t nbytes,
+        pa_free_cb_t free_cb, void *free_cb_data, int64_t offset,
+        pa_seek_mode_t seek)
+{
+    fake_stats.written += nbytes;
+    if (free_cb)
+        free_cb(free_cb_data);
+    return 0;
+}
+
+int pa_stream_write(pa_stream *s, const void *data, size_t nbytes,
+        pa_free_cb_t free_cb, int64_t offset, pa_seek_mode_t seek)
+{
+    fake_stats.written += nbytes;
+    if (free_cb)
+        free_cb((void*)data);
+    return 0;
+}
+
+pa_operation* pa_stream_cork(pa_stream *s, int b, pa_stream_success_cb_t cb,
+        void *userdata)
+{
+    /* playback starts as soon as the stream is uncorked */
+    if (!traced && !b && !s->record && !s->started && s->started_cb) {
+        s->started = 1;
+        s->started_cb(s, s->started_data);
+    }
+    return &operation;
+}
+
+pa_operation* pa_stream_flush(pa_stream *s, pa_stream_success_cb_t cb,
+        void *userdata)
+{
+    s->readable = 0;
+    return &operation;
+}
+
+pa_operation* pa_stream_update_sample_rate(pa_stream *s, uint32_t rate,
+        pa_stream_success_cb_t cb, void *userdata)
+{
+    s->spec.rate = rate;
+    return &operation;
+}
+
+pa_operation* pa_stream_set_buffer_attr(pa_stream *s,
+        const pa_buffer_attr *attr, pa_stream_success_cb_t cb, void *userdata)
+{
+    s->attr = *attr;
+    if (cb)
+        cb(s, 1, userdata);
+    return &operation;
+}
+
+const pa_timing_info* pa_stream_get_timing_info(pa_stream *s)
+{
+    return s->state == PA_STREAM_READY ? &s->timing : NULL;
+}
+
+int pa_stream_get_latency(pa_stream *s, pa_usec_t *r_usec, int *negative)
+{
+    *r_usec = 0;
+    *negative = 0;
+    return 0;
+}
+
+const pa_buffer_attr* pa_stream_get_buffer_attr(pa_stream *s)
+{
+    return &s->attr;
+}
+
+const pa_sample_spec* pa_stream_get_sample_spec(pa_stream *s)
+{
+    return &s->spec;
+}
+
+const char* pa_stream_get_device_name(const pa_stream *s)
+{
+    return s->device;
+}
+
+uint32_t pa_stream_get_index(const pa_stream *s)
+{
+    return 0;
+}
+
+uint32_t pa_stream_get_device_index(const pa_stream *s)
+{
+    return s->device_idx;
+}
+
+/* Driving it from the replay */
+
+pa_context* fake_context(unsigned int server)
+{
+    return server < n_contexts ? contexts[server] : NULL;
+}
+
+/* Run deferred work and timers up to usec, in order */
+void fake_advance(pa_usec_t usec)
+{
+    pa_time_event *e, *next, *first;
+    struct deferred *d;
+    struct timeval tv;
+
+    for (;;) {
+        while ((d = list_top(&deferreds, struct deferred, list))) {
+            list_del(&d->list);
+            d->cb(d->data);
+            free(d);
+        }
+
+        first = NULL;
+        list_for_each_safe(&timers, e, next, list) {
+            if (e->dead) {
+                list_del(&e->list);
+                free(e);
+            } else if (e->when <= usec && (!first || e->when < first->when))
+                first = e;
+        }
+        if (first == NULL)
+            break;
+
+        if (first->when > now_usec)
+            now_usec = first->when;
+        /* fired timers stay put unless restarted, like rttime ones */
+        first->when = (pa_usec_t)-1;
+        first->cb(&fake_api, first, pa_timeval_store(&tv, now_usec),
+                first->data);
+        fake_stats.timers++;
+    }
+
+    if (usec > now_usec)
+        now_usec = usec;
+}
+
+void fake_event(unsigned int server, uint32_t type, uint32_t idx)
+{
+    pa_context *c = fake_context(server);
+    unsigned int facility = type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
+
+    if (c && c->subscribe_cb && (c->mask & (1u << facility)))
+        c->subscribe_cb(c, type, idx, c->subscribe_data);
+}
+
+static struct pending* pending_find(pa_context *c, enum pending_kind kind,
+        uint32_t idx)
+{
+    struct pending *p;
+
+    list_for_each(&pendings, p, list) {
+        if (p->context == c && p->kind == kind &&
+                (idx == PA_INVALID_INDEX || p->idx == idx))
+            return p;
+    }
+
+    return NULL;
+}
+
+static void source_name_add(unsigned int server, const pa_source_info *i)
+{
+    struct source_name *n;
+
+    list_for_each(&source_names, n, list) {
+        if (n->server == server && n->idx == i->index)
+            return;
+    }
+
+    n = calloc(1, sizeof(*n));
+    n->server = server;
+    n->idx = i->index;
+    n->name = strdup(i->name);
+    list_add_tail(&source_names, &n->list);
+}
+
+/* Hand a recorded source reply to the request it most likely answered:
+ * the oldest one for that index, or else the oldest listing. Returns 1
+ * if there was none. A lookup ends with an eol of its own, as the
+ * daemon traces that too. */
+int fake_source(unsigned int server, const pa_source_info *i, int eol)
+{
+    pa_context *c = fake_context(server);
+    struct pending *p;
+
+    if (c == NULL)
+        return 1;
+
+    if (!eol) {
+        source_name_add(server, i);
+        p = pending_find(c, PENDING_SOURCE, i->index);
+        if (p == NULL)
+            p = pending_find(c, PENDING_SOURCE_LIST, PA_INVALID_INDEX);
+    } else {
+        /* a listing ends with 1, a lookup that failed with -1 */
+        p = pending_find(c, eol > 0 ? PENDING_SOURCE_LIST : PENDING_SOURCE,
+                PA_INVALID_INDEX);
+    }
+    if (p == NULL)
+        return 1;
+
+    /* an answered lookup waits for its end like a listing */
+    if (!eol)
+        p->kind = PENDING_SOURCE_LIST;
+    else
+        list_del(&p->list);
+
+    p->cb.source(c, i, eol, p->data);
+    if (eol)
+        free(p);
+    return 0;
+}
+
+int fake_sink(unsigned int server, const pa_sink_info *i, int eol)
+{
+    pa_context *c = fake_context(server);
+    struct pending *p;
+
+    if (c == NULL || (p = pending_find(c, PENDING_SINK,
+                    PA_INVALID_INDEX)) == NULL)
+        return 1;
+
+    if (!eol) {
+        p->cb.sink(c, i, 0, p->data);
+        return 0;
+    }
+
+    list_del(&p->list);
+    p->cb.sink(c, NULL, eol, p->data);
+    free(p);
+    return 0;
+}
+
+/* Deliver len bytes of silence to the record streams of a source, as
+ * there are two while a loopback is being replaced. Returns 1 if
+ * nobody is recording it. */
+int fake_read(unsigned int server, uint32_t idx, size_t len)
+{
+    pa_stream *s, *found[4];
+    unsigned int i, n = 0;
+
+    list_for_each(&streams, s, list) {
+        if (s->record && s->state == PA_STREAM_READY && s->read_cb &&
+                s->context->id == server && s->device_idx == idx &&
+                n < G_N_ELEMENTS(found))
+            found[n++] = pa_stream_ref(s);
+    }
+    if (!n)
+        return 1;
+
+    if (len > silence_size) {
+        silence = realloc(silence, len);
+        memset(silence, 0, len);
+        silence_size = len;
+    }
+
+    /* a read may free the other stream, or disconnect this one */
+    for (i = 0; i < n; i++) {
+        s = found[i];
+        if (s->state == PA_STREAM_READY && s->read_cb) {
+            s->readable = len;
+            s->read_cb(s, len, s->read_data);
+            fake_stats.read += len;
+        }
+        pa_stream_unref(s);
+    }
+    return 0;
+}
+
+static pa_stream* stream_find(unsigned int server, uint32_t serial)
+{
+    pa_stream *s;
+
+    list_for_each(&streams, s, list) {
+        if (s->context->id == server && s->serial == serial)
+            return s;
+    }
+
+    return NULL;
+}
+
+/* Returns 1 if the stream is gone, or wasn't connected */
+int fake_stream(unsigned int server, uint32_t serial,
+        pa_stream_state_t state)
+{
+    pa_stream *s = stream_find(server, serial);
+
+    if (s == NULL || (s->state != PA_STREAM_CREATING &&
+                s->state != PA_STREAM_READY))
+        return 1;
+
+    /* the callback may well free it */
+    pa_stream_ref(s);
+    s->state = state;
+    if (s->state_cb)
+        s->state_cb(s, s->state_data);
+    pa_stream_unref(s);
+    return 0;
+}
+
+int fake_started(unsigned int server, uint32_t serial)
+{
+    pa_stream *s = stream_find(server, serial);
+
+    if (s == NULL || s->state != PA_STREAM_READY)
+        return 1;
+
+    if (s->started_cb)
+        s->started_cb(s, s->started_data);
+    return 0;
+}
+
+int fake_underflow(unsigned int server, uint32_t serial)
+{
+    pa_stream *s = stream_find(server, serial);
+
+    if (s == NULL || s->state != PA_STREAM_READY)
+        return 1;
+
+    if (s->underflow_cb)
+        s->underflow_cb(s, s->underflow_data);
+    return 0;
+}
+
+/* Hand a recorded entry or end of a listing to the oldest request for
+ * one. Returns 1 if there was none. */
+static int list_reply(unsigned int server, enum pending_kind kind,
+        const void *i, int eol)
+{
+    pa_context *c = fake_context(server);
+    struct pending *p;
+
+    if (c == NULL || (p = pending_find(c, kind, PA_INVALID_INDEX)) == NULL)
+        return 1;
+
+    if (eol)
+        list_del(&p->list);
+    if (kind == PENDING_CLIENT_LIST)
+        p->cb.client(c, (const pa_client_info*)i, eol, p->data);
+    else
+        p->cb.module(c, (const pa_module_info*)i, eol, p->data);
+    if (eol)
+        free(p);
+    return 0;
+}
+
+int fake_client(unsigned int server, const pa_client_info *i, int eol)
+{
+    return list_reply(server, PENDING_CLIENT_LIST, i, eol);
+}
+
+int fake_module(unsigned int server, const pa_module_info *i, int eol)
+{
+    return list_reply(server, PENDING_MODULE_LIST, i, eol);
+}
+
+void fake_traced(void)
+{
+    traced = 1;
+}
+
+int fake_quit_requested(void)
+{
+    return quit_requested;
+}
+
+void fake_free(void)
+{
+    struct pending *p;
+    struct source_name *n;
+    pa_time_event *e;
+    unsigned int i;
+
+    fake_advance(now_usec);
+    while ((p = list_top(&pendings, struct pending, list))) {
+        list_del(&p->list);
+        free(p);
+    }
+    while ((n = list_top(&source_names, struct source_name, list))) {
+        list_del(&n->list);
+        free(n->name);
+        free(n);
+    }
+    while ((e = list_top(&timers, pa_time_event, list))) {
+        list_del(&e->list);
+        free(e);
+    }
+    for (i = 0; i < n_contexts; i++)
+        free(contexts[i]);
+    free(silence);
+}
@@ -0,0 +1,26 @@
+/* Driving the libpulse stand-in in fakepulse.c */
+
+struct fake_stats {
+    uint64_t read;
+    uint64_t written;
+    unsigned int timers;
+};
+
+extern struct fake_stats fake_stats;
+extern pa_mainloop_api fake_api;
+
+pa_context* fake_context(unsigned int server);
+void fake_advance(pa_usec_t usec);
+void fake_event(unsigned int server, uint32_t type, uint32_t idx);
+int fake_source(unsigned int server, const pa_source_info *i, int eol);
+int fake_sink(unsigned int server, const pa_sink_info *i, int eol);
+int fake_read(unsigned int server, uint32_t idx, size_t len);
+int fake_stream(unsigned int server, uint32_t serial,
+        pa_stream_state_t state);
+int fake_started(unsigned int server, uint32_t serial);
+int fake_underflow(unsigned int server, uint32_t serial);
+int fake_client(unsigned int server, const pa_client_info *i, int eol);
+int fake_module(unsigned int server, const pa_module_info *i, int eol);
+void fake_traced(void);
+int fake_quit_requested(void);
+void fake_free(void);
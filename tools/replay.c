@@ -0,0 +1,468 @@
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pulse/pulseaudio.h>
+
+#include "src/log.h"
+#include "src/bluepulse.h"
+#include "src/defaults.h"
+#include "tools/fakepulse.h"
+
+/* Plays a --trace recording back through the daemon's own callbacks,
+ * with libpulse replaced by fakepulse.c, and reports the CPU time spent
+ * on each kind of record. At full speed (the default) the virtual clock
+ * jumps from record to record, so runs are repeatable; with --realtime
+ * the original pacing is kept. */
+
+struct config config;
+
+static const char *type_names[] = {"event", "source", "sink", "read",
+    "stream", "started", "underflow", "client", "module"};
+
+struct record {
+    pa_usec_t usec;
+    enum trace_type type;
+    unsigned int server;
+    uint32_t event;
+    uint32_t idx;
+    uint32_t serial;
+    pa_stream_state_t state;
+    int eol;
+    size_t len;
+    pa_source_info source;
+    pa_sink_info sink;
+    pa_client_info client;
+    pa_module_info module;
+    char *strings[5];
+};
+
+static struct {
+    unsigned long count;
+    uint64_t cpu_ns, max_ns;
+    unsigned long unmatched;
+} totals[TRACE_MODULE + 2];
+
+void quit(int retval)
+{
+    fake_api.quit(&fake_api, retval);
+}
+
+static int get_byte(FILE *f, uint8_t *b)
+{
+    int c = getc_unlocked(f);
+
+    if (c == EOF)
+        return 1;
+    *b = c;
+    return 0;
+}
+
+static int get_varint(FILE *f, uint64_t *v)
+{
+    unsigned int shift = 0;
+    uint8_t b;
+
+    *v = 0;
+    do {
+        if (shift > 63 || get_byte(f, &b))
+            return 1;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    return 0;
+}
+
+static int get_string(FILE *f, char **s)
+{
+    uint64_t len;
+
+    free(*s);
+    *s = NULL;
+    if (get_varint(f, &len))
+        return 1;
+    if (!len--)
+        return 0;
+
+    *s = malloc(len + 1);
+    if (fread(*s, 1, len, f) != len)
+        return 1;
+    (*s)[len] = '\0';
+    return 0;
+}
+
+static void set_prop(pa_proplist *p, const char *key, const char *value)
+{
+    if (value)
+        pa_proplist_sets(p, key, value);
+}
+
+static int read_source(FILE *f, struct record *r)
+{
+    pa_source_info *i = &r->source;
+    uint64_t idx, rate;
+    uint8_t format, channels, state;
+    unsigned int n;
+
+    if (get_varint(f, &idx) || get_byte(f, &format) ||
+            get_varint(f, &rate) || get_byte(f, &channels) ||
+            get_byte(f, &state))
+        return 1;
+    for (n = 0; n < G_N_ELEMENTS(r->strings); n++) {
+        if (get_string(f, &r->strings[n]))
+            return 1;
+    }
+
+    i->index = idx;
+    i->sample_spec.format = format;
+    i->sample_spec.rate = rate;
+    i->sample_spec.channels = channels;
+    i->state = (int8_t)state;
+    i->name = r->strings[0] ? r->strings[0] : "";
+    i->description = r->strings[1] ? r->strings[1] : "";
+
+    pa_proplist_clear(i->proplist);
+    set_prop(i->proplist, "bluetooth.protocol", r->strings[2]);
+    set_prop(i->proplist, "bluetooth.codec", r->strings[3]);
+    set_prop(i->proplist, PA_PROP_DEVICE_STRING, r->strings[4]);
+    return 0;
+}
+
+static int read_client(FILE *f, struct record *r)
+{
+    pa_client_info *i = &r->client;
+    uint64_t idx;
+    uint8_t self;
+    char pid[16];
+
+    if (get_varint(f, &idx) || get_string(f, &r->strings[0]) ||
+            get_string(f, &r->strings[1]) || get_byte(f, &self))
+        return 1;
+
+    i->index = idx;
+    pa_proplist_clear(i->proplist);
+    set_prop(i->proplist, PA_PROP_APPLICATION_NAME, r->strings[0]);
+    /* the daemon was traced as itself, it has our pid now */
+    if (self)
+        snprintf(pid, sizeof(pid), "%d", getpid());
+    set_prop(i->proplist, PA_PROP_APPLICATION_PROCESS_ID,
+            self ? pid : r->strings[1]);
+    return 0;
+}
+
+static int read_module(FILE *f, struct record *r)
+{
+    pa_module_info *i = &r->module;
+    uint64_t idx;
+
+    if (get_varint(f, &idx) || get_string(f, &r->strings[0]) ||
+            get_string(f, &r->strings[1]))
+        return 1;
+
+    i->index = idx;
+    i->name = r->strings[0] ? r->strings[0] : "";
+    i->argument = r->strings[1];
+    return 0;
+}
+
+/* Returns 0 for a record, 1 at the end and -1 if it is cut short */
+static int read_record(FILE *f, struct record *r)
+{
+    uint64_t delta, a, b;
+    uint8_t byte, eol;
+
+    if (get_varint(f, &delta))
+        return 1;
+    if (get_byte(f, &byte))
+        return -1;
+
+    r->usec += delta;
+    r->type = byte & 0xf;
+    r->server = byte >> 4;
+
+    switch (r->type) {
+        case TRACE_EVENT:
+            if (get_varint(f, &a) || get_varint(f, &b))
+                return -1;
+            r->event = a;
+            r->idx = b;
+            return 0;
+
+        case TRACE_SOURCE:
+            if (get_byte(f, &eol))
+                return -1;
+            r->eol = (int8_t)eol;
+            return r->eol || !read_source(f, r) ? 0 : -1;
+
+        case TRACE_SINK:
+            if (get_byte(f, &eol))
+                return -1;
+            r->eol = (int8_t)eol;
+            if (r->eol)
+                return 0;
+            if (get_byte(f, &byte) || get_varint(f, &a) ||
+                    get_byte(f, &eol))
+                return -1;
+            r->sink.sample_spec.format = byte;
+            r->sink.sample_spec.rate = a;
+            r->sink.sample_spec.channels = eol;
+            return 0;
+
+        case TRACE_READ:
+            if (get_varint(f, &a) || get_varint(f, &b))
+                return -1;
+            r->idx = a;
+            r->len = b;
+            return 0;
+
+        case TRACE_STREAM:
+            if (get_varint(f, &a) || get_byte(f, &byte))
+                return -1;
+            r->serial = a;
+            r->state = (int8_t)byte;
+            return 0;
+
+        case TRACE_STARTED:
+        case TRACE_UNDERFLOW:
+            if (get_varint(f, &a))
+                return -1;
+            r->serial = a;
+            return 0;
+
+        case TRACE_CLIENT:
+            if (get_byte(f, &eol))
+                return -1;
+            r->eol = (int8_t)eol;
+            return r->eol || !read_client(f, r) ? 0 : -1;
+
+        case TRACE_MODULE:
+            if (get_byte(f, &eol))
+                return -1;
+            r->eol = (int8_t)eol;
+            return r->eol || !read_module(f, r) ? 0 : -1;
+    }
+
+    return -1;
+}
+
+static int dispatch(struct record *r)
+{
+    switch (r->type) {
+        case TRACE_EVENT:
+            fake_event(r->server, r->event, r->idx);
+            return 0;
+        case TRACE_SOURCE:
+            return fake_source(r->server, r->eol ? NULL : &r->source, r->eol);
+        case TRACE_SINK:
+            return fake_sink(r->server, r->eol ? NULL : &r->sink, r->eol);
+        case TRACE_READ:
+            return fake_read(r->server, r->idx, r->len);
+        case TRACE_STREAM:
+            return fake_stream(r->server, r->serial, r->state);
+        case TRACE_STARTED:
+            return fake_started(r->server, r->serial);
+        case TRACE_UNDERFLOW:
+            return fake_underflow(r->server, r->serial);
+        case TRACE_CLIENT:
+            return fake_client(r->server, r->eol ? NULL : &r->client,
+                    r->eol);
+        case TRACE_MODULE:
+            return fake_module(r->server, r->eol ? NULL : &r->module,
+                    r->eol);
+    }
+
+    return 1;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t wall_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void account(unsigned int type, uint64_t ns)
+{
+    totals[type].count++;
+    totals[type].cpu_ns += ns;
+    if (ns > totals[type].max_ns)
+        totals[type].max_ns = ns;
+}
+
+static void report(pa_usec_t traced, uint64_t wall)
+{
+    uint64_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < G_N_ELEMENTS(totals); i++)
+        total += totals[i].cpu_ns;
+
+    printf("%.1f s of trace replayed in %.3f s, %.3f s of CPU in the "
+            "daemon\n", traced / 1e6, wall / 1e6, total / 1e9);
+    printf("%-9s %10s %10s %10s %10s %10s\n", "record", "count",
+            "total ms", "mean us", "max us", "unmatched");
+    for (i = 0; i < G_N_ELEMENTS(totals); i++) {
+        if (!totals[i].count && !totals[i].unmatched)
+            continue;
+        printf("%-9s %10lu %10.2f %10.2f %10.2f %10lu\n",
+                i <= TRACE_MODULE ? type_names[i] : "timers",
+                totals[i].count, totals[i].cpu_ns / 1e6,
+                totals[i].count ? totals[i].cpu_ns / 1e3 /
+                totals[i].count : 0.0,
+                totals[i].max_ns / 1e3, totals[i].unmatched);
+    }
+    printf("%llu bytes read, %llu written to sinks\n",
+            (unsigned long long)fake_stats.read,
+            (unsigned long long)fake_stats.written);
+}
+
+static void usage(FILE *f)
+{
+    fprintf(f, "Usage: replay [OPTIONS] TRACE\n"
+            "  -r, --realtime         keep the recorded pacing\n"
+            "  -R, --resample=QUALITY resample as with bluepulse --resample\n"
+            "  -q, --quiet            hide the daemon's messages\n"
+            "  -s, --stats            print the daemon's statistics at the "
+            "end\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        {"realtime", no_argument, NULL, 'r'},
+        {"resample", required_argument, NULL, 'R'},
+        {"quiet", no_argument, NULL, 'q'},
+        {"stats", no_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    static const char *qualities[] = {"off", "fast", "medium", "best"};
+    int opt, realtime = 0, quiet = 0, stats = 0, ret, saved = -1;
+    uint64_t magic, servers, start, t0, ns;
+    struct record r;
+    unsigned int i;
+    FILE *f;
+
+    config = defaults;
+    while ((opt = getopt_long(argc, argv, "rR:qsh", options, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                realtime = 1;
+                break;
+            case 'R':
+                for (i = 0; i < G_N_ELEMENTS(qualities); i++) {
+                    if (!strcmp(optarg, qualities[i]))
+                        config.resample = i;
+                }
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            case 's':
+                stats = 1;
+                break;
+            case 'h':
+                usage(stdout);
+                return 0;
+            default:
+                usage(stderr);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(stderr);
+        return 1;
+    }
+
+    f = fopen(argv[optind], "r");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (get_varint(f, &magic) || (magic != TRACE_MAGIC &&
+                magic != TRACE_MAGIC_V1) ||
+            get_varint(f, &servers) || !servers || servers > MAX_SERVERS) {
+        fprintf(stderr, "%s is not a bluepulse trace\n", argv[optind]);
+        return 1;
+    }
+    /* older traces leave stream callbacks to the fake */
+    if (magic == TRACE_MAGIC)
+        fake_traced();
+
+    /* one context per server, in the order they were traced */
+    config.n_servers = servers;
+    for (i = 0; i < servers; i++)
+        config.servers[i] = "replay";
+
+    if (quiet) {
+        fflush(stderr);
+        saved = dup(STDERR_FILENO);
+        dup2(open("/dev/null", O_WRONLY), STDERR_FILENO);
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.source.proplist = pa_proplist_new();
+    r.client.proplist = pa_proplist_new();
+
+    pulse_init(&fake_api);
+    start = wall_usec();
+
+    while ((ret = read_record(f, &r)) == 0 && !fake_quit_requested()) {
+        if (realtime) {
+            t0 = wall_usec() - start;
+            if (r.usec > t0)
+                usleep(r.usec - t0);
+        }
+
+        t0 = cpu_ns();
+        fake_advance(r.usec);
+        ns = cpu_ns() - t0;
+        if (ns)
+            account(TRACE_MODULE + 1, ns);
+
+        t0 = cpu_ns();
+        if (dispatch(&r))
+            totals[r.type].unmatched++;
+        else
+            account(r.type, cpu_ns() - t0);
+    }
+
+    if (ret < 0)
+        fprintf(stderr, "Trace is cut short\n");
+
+    /* let pending timers run, as the daemon would have */
+    fake_advance(r.usec + PA_USEC_PER_SEC);
+
+    if (quiet) {
+        fflush(stderr);
+        dup2(saved, STDERR_FILENO);
+    }
+    if (stats)
+        pulse_stats();
+
+    report(r.usec, wall_usec() - start);
+
+    pulse_quit();
+    fake_free();
+    pa_proplist_free(r.source.proplist);
+    pa_proplist_free(r.client.proplist);
+    for (i = 0; i < G_N_ELEMENTS(r.strings); i++)
+        free(r.strings[i]);
+    fclose(f);
+
+    return ret < 0;
+}
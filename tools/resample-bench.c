@@ -0,0 +1,158 @@
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "src/bluepulse.h"
+
+/* Compares the resampler quality presets and kernels: THD+N of a
+ * converted 1 kHz sine against the CPU time it took. */
+
+#define TONE_HZ 1000
+#define SECONDS 10
+#define CHANNELS 2
+#define FRAGMENT 441    /* 10ms at 44.1kHz, about what PA hands us */
+
+static const struct {
+    const char *name;
+    enum resample_quality quality;
+} qualities[] = {
+    {"fast", RESAMPLE_FAST},
+    {"medium", RESAMPLE_MEDIUM},
+    {"best", RESAMPLE_BEST},
+};
+
+static const char *kernels[] = {"scalar", "sse", "avx2"};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fit and remove the tone, whatever is left is distortion and noise.
+ * Only whole periods are used so the fit reduces to two correlations. */
+static double thd_n(const float *x, size_t frames, uint32_t rate)
+{
+    size_t period = rate / TONE_HZ, n, i;
+    double a = 0, b = 0, signal, noise = 0;
+
+    /* skip the filter's start up */
+    x += rate / 10 * CHANNELS;
+    frames -= rate / 10;
+    n = frames / period * period;
+
+    for (i = 0; i < n; i++) {
+        double w = 2 * M_PI * TONE_HZ * i / rate;
+        a += x[i * CHANNELS] * sin(w);
+        b += x[i * CHANNELS] * cos(w);
+    }
+    a *= 2.0 / n;
+    b *= 2.0 / n;
+
+    for (i = 0; i < n; i++) {
+        double w = 2 * M_PI * TONE_HZ * i / rate;
+        double e = x[i * CHANNELS] - a * sin(w) - b * cos(w);
+        noise += e * e;
+    }
+
+    signal = (a * a + b * b) / 2;
+    return 10 * log10(noise / n / signal);
+}
+
+static void run(uint32_t in_rate, uint32_t out_rate, int s16)
+{
+    size_t in_frames = (size_t)in_rate * SECONDS, out_frames, done, i, q, k;
+    float *in, *out;
+    int16_t *in16, *out16;
+
+    in = malloc(sizeof(float) * in_frames * CHANNELS);
+    in16 = malloc(sizeof(int16_t) * in_frames * CHANNELS);
+    for (i = 0; i < in_frames * CHANNELS; i++) {
+        in[i] = 0.5 * sin(2 * M_PI * TONE_HZ * (i / CHANNELS) / in_rate);
+        in16[i] = lrintf(in[i] * 32767);
+    }
+
+    out_frames = (size_t)out_rate * SECONDS + FRAGMENT * 2;
+    out = malloc(sizeof(float) * out_frames * CHANNELS);
+    out16 = malloc(sizeof(int16_t) * out_frames * CHANNELS);
+
+    for (q = 0; q < sizeof(qualities) / sizeof(qualities[0]); q++) {
+        for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            struct resampler *r;
+            double start, cpu;
+
+            r = resampler_new(CHANNELS, in_rate, out_rate,
+                    qualities[q].quality);
+            if (r == NULL) {
+                fprintf(stderr, "Unsupported rates %u -> %u\n",
+                        in_rate, out_rate);
+                exit(1);
+            }
+            if (resampler_set_kernel(r, kernels[k])) {
+                resampler_free(r);
+                continue;
+            }
+
+            done = 0;
+            start = now();
+            for (i = 0; i < in_frames; i += FRAGMENT) {
+                size_t n = in_frames - i < FRAGMENT ? in_frames - i : FRAGMENT;
+                if (s16)
+                    done += resampler_process_s16(r, in16 + i * CHANNELS, n,
+                            out16 + done * CHANNELS);
+                else
+                    done += resampler_process_float(r, in + i * CHANNELS, n,
+                            out + done * CHANNELS);
+            }
+            cpu = now() - start;
+            resampler_free(r);
+
+            if (s16) {
+                for (i = 0; i < done * CHANNELS; i++)
+                    out[i] = out16[i] / 32768.0f;
+            }
+
+            printf("%-4s %5u -> %5u  %-6s %-6s  THD+N %7.1f dB  "
+                    "%6.1f ns/frame  %6.0fx realtime\n",
+                    s16 ? "s16" : "f32", in_rate, out_rate,
+                    qualities[q].name, kernels[k],
+                    thd_n(out, done, out_rate), cpu * 1e9 / done,
+                    SECONDS / cpu);
+        }
+    }
+
+    free(in);
+    free(in16);
+    free(out);
+    free(out16);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t in_rate = 44100, out_rate = 48000;
+
+    if (argc == 3) {
+        in_rate = atoi(argv[1]);
+        out_rate = atoi(argv[2]);
+    }
+    else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [IN_RATE OUT_RATE]\n", argv[0]);
+        return 1;
+    }
+
+    /* thd_n() needs whole periods of the tone */
+    if (!in_rate || !out_rate || out_rate % TONE_HZ) {
+        fprintf(stderr, "Output rate must be a multiple of %u Hz\n",
+                TONE_HZ);
+        return 1;
+    }
+
+    run(in_rate, out_rate, 0);
+    run(in_rate, out_rate, 1);
+    return 0;
+}